@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Run stored as a part of an anonymous container file
+struct FileExtent {
+    // descriptor of the container, shared by all its extents and owned by AnonymousFiles, must not be closed
+    int file_descriptor;
+    long long offset;
+    long long size;
+};
+
+// Temporary runs which have no name in the file system
+// Runs are kept as extents of few big container files, so that thousands of runs are read and written
+// through a handful of descriptors: every writer takes a container nobody else writes into (or a new one)
+// and appends its run at the end of it, readers read extents of runs with pread through the shared descriptor
+// Container is created with O_TMPFILE (or created and unlinked at once, where O_TMPFILE is not supported)
+// in the directory of the name its first run is registered under, so the kernel frees it when its last run
+// is removed or the process exits, even if it crashes
+// Space of removed runs is released with a hole punched into the container
+class AnonymousFiles {
+public:
+    // Starts an anonymous run registered under file_name at the end of a free container of its directory,
+    // returns extent to write the run into, its descriptor is -1 on failure
+    // Run must be finished with Finish before the container is used by another run
+    static FileExtent Create(std::string file_name) {
+        size_t slash = file_name.rfind('/');
+        std::string directory = (slash == std::string::npos ? "." : file_name.substr(0, slash + 1));
+        AnonymousFiles &files = GetInstance();
+        std::lock_guard<std::mutex> lock(files.mutex_);
+
+        std::shared_ptr<Container> container;
+        for (const std::shared_ptr<Container> &free_container: files.free_containers_) {
+            if (free_container->directory == directory) {
+                container = free_container;
+                break;
+            }
+        }
+        if (container) {
+            files.free_containers_.erase(container);
+        } else {
+            int file_descriptor = open(directory.c_str(), O_TMPFILE | O_RDWR, 0600);
+            if (file_descriptor < 0) {
+                file_descriptor = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+                if (file_descriptor >= 0) {
+                    ::remove(file_name.c_str());
+                }
+            }
+            if (file_descriptor < 0) {
+                return FileExtent {-1, 0, 0};
+            }
+            container = std::make_shared<Container>(file_descriptor, directory);
+        }
+
+        files.RemoveRun(file_name);
+        files.runs_[file_name] = Run {container, FileExtent {container->file_descriptor, container->end, 0}};
+        ++container->runs_count;
+        return files.runs_[file_name].extent;
+    }
+
+    // Finishes run registered under file_name, which has size bytes, and frees its container for other runs
+    static void Finish(std::string file_name, long long size) {
+        AnonymousFiles &files = GetInstance();
+        std::lock_guard<std::mutex> lock(files.mutex_);
+        auto run = files.runs_.find(file_name);
+        if (run != files.runs_.end()) {
+            run->second.extent.size = size;
+            run->second.container->end = run->second.extent.offset + size;
+            files.free_containers_.insert(run->second.container);
+        }
+    }
+
+    // Returns whether an anonymous run is registered under file_name, and its extent if it is
+    static bool Find(std::string file_name, FileExtent *extent) {
+        AnonymousFiles &files = GetInstance();
+        std::lock_guard<std::mutex> lock(files.mutex_);
+        auto run = files.runs_.find(file_name);
+        if (run == files.runs_.end()) {
+            return false;
+        }
+        *extent = run->second.extent;
+        return true;
+    }
+
+    // Releases anonymous run registered under file_name, or removes file with the name if none is
+    static void Remove(std::string file_name) {
+        AnonymousFiles &files = GetInstance();
+        {
+            std::lock_guard<std::mutex> lock(files.mutex_);
+            if (files.RemoveRun(file_name)) {
+                return;
+            }
+        }
+        ::remove(file_name.c_str());
+    }
+
+private:
+    struct Container {
+        Container(int file_descriptor, std::string directory) :
+            file_descriptor(file_descriptor),
+            directory(directory),
+            end(0),
+            runs_count(0)
+        {}
+
+        ~Container() {
+            close(file_descriptor);
+        }
+
+        int file_descriptor;
+        std::string directory;
+        // offset after the last run
+        long long end;
+        int runs_count;
+    };
+
+    struct Run {
+        std::shared_ptr<Container> container;
+        FileExtent extent;
+    };
+
+    static AnonymousFiles &GetInstance() {
+        static AnonymousFiles files;
+        return files;
+    }
+
+    // Punches out space of the run, container is closed with its last run, returns false if there is no such run
+    bool RemoveRun(std::string file_name) {
+        auto run = runs_.find(file_name);
+        if (run == runs_.end()) {
+            return false;
+        }
+        std::shared_ptr<Container> container = run->second.container;
+        const FileExtent &extent = run->second.extent;
+        if (extent.size > 0) {
+            fallocate(extent.file_descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, extent.offset, extent.size);
+        }
+        runs_.erase(run);
+        if (--container->runs_count == 0) {
+            free_containers_.erase(container);
+        }
+        return true;
+    }
+
+    std::mutex mutex_;
+    std::map<std::string, Run> runs_;
+    // containers nobody writes into, every container is closed when the last pointer to it is gone
+    std::set<std::shared_ptr<Container>> free_containers_;
+};
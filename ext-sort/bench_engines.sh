@@ -0,0 +1,15 @@
+#!/bin/bash
+# Compares running time of sorting engines on random files of growing size,
+# from files fitting into L2 cache up to files not fitting into RAM.
+# K-way merge is run with its default block size and branching degree,
+# funnel sort has no parameters to tune.
+
+for file in 262144 8388608 268435456 4294967296 ;
+do
+    head -c $file < /dev/urandom > input_bin
+    for engine in merge distribution funnel ;
+    do
+        echo "$file $engine" ;
+        time ./ext_sort input_bin output_bin -e "$engine" ;
+    done ;
+done
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Compares dTLB misses and running time of sorting with buffers on transparent huge pages and on 4 KB pages.
+# Run as root: transparent huge pages are switched off for the second run through sysfs,
+# and the previous setting is restored at the end.
+# Input fits into one block, so most of the time is spent sorting it in memory.
+
+thp=/sys/kernel/mm/transparent_hugepage/enabled
+previous_mode=$(sed 's/.*\[\(.*\)\].*/\1/' $thp)
+file=1073741824
+
+head -c $file < /dev/urandom > input_bin
+for mode in madvise never ;
+do
+    echo $mode > $thp
+    echo "transparent huge pages: $mode" ;
+    perf stat -e dTLB-load-misses,dTLB-store-misses,task-clock ./ext_sort input_bin output_bin -b $file ;
+done
+echo $previous_mode > $thp
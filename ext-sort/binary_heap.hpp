@@ -36,7 +36,23 @@ class BinaryHeap {
         const TElement& GetTop() const {
             return elements_.front();
         }
+        // Returns element which will be on the top after Pop()
+        // Heap must have at least two elements
+        const TElement& GetNextTop() const {
+            if (GetSize() > 2 && CompareElements(elements_[1], elements_[2])) {
+                return elements_[2];
+            }
+            return elements_[1];
+        }
         void Insert(const TElement& element);
+        // Replaces element on the top of the heap with a new one,
+        // cheaper than Pop() followed by Insert()
+        void ReplaceTop(const TElement& element) {
+            TDeleteCallback()(elements_[0]);
+            elements_[0] = element;
+            TInsertCallback()(elements_[0], 0);
+            HeapifyDown(0);
+        }
         // Removes element which is located by index, keeping all heap properties
         void RemoveElementByIndex(TIndex index) {
             DeleteElement(index);
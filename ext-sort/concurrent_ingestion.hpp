@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include "external_sort.hpp"
+#include "run_file.hpp"
+
+// Front end which lets many threads feed values into one external sort
+// Every producer collects values in a buffer of its own, and sorts and writes it as a run when it is full,
+// so producers never wait for each other. Finish() merges runs of all producers into the output file
+class ConcurrentIngestion {
+public:
+    // Values of one producer thread
+    // Producer must be used by one thread at a time, different producers may be used concurrently
+    class Producer {
+    public:
+        void Push(uint64_t value) {
+            buffer_[buffer_filled_++] = value;
+            if (buffer_filled_ == buffer_.size()) {
+                Spill();
+            }
+        }
+
+        void Push(const uint64_t *values, size_t count) {
+            while (count > 0) {
+                size_t portion = std::min(count, buffer_.size() - buffer_filled_);
+                std::copy(values, values + portion, buffer_.begin() + buffer_filled_);
+                buffer_filled_ += portion;
+                values += portion;
+                count -= portion;
+                if (buffer_filled_ == buffer_.size()) {
+                    Spill();
+                }
+            }
+        }
+
+        // Writes values left in the buffer and frees it, producer can't be used after that
+        void Close() {
+            Spill();
+            ValueBuffer().swap(buffer_);
+        }
+
+    private:
+        friend class ConcurrentIngestion;
+
+        Producer(ConcurrentIngestion *ingestion, long long buffer_size) :
+            ingestion_(ingestion),
+            buffer_(std::max(1LL, buffer_size)),
+            buffer_filled_(0)
+        {}
+
+        void Spill() {
+            if (buffer_filled_ == 0) {
+                return;
+            }
+            std::sort(buffer_.begin(), buffer_.begin() + buffer_filled_);
+
+            std::string run_file_name = ingestion_->temp_file_name_mask_ + std::to_string(ingestion_->next_run_number_++);
+            RunWriter run_file(run_file_name, true);
+            run_file.Write(&buffer_[0], buffer_filled_);
+            run_file.Close();
+
+            run_file_names_.push_back(run_file_name);
+            buffer_filled_ = 0;
+        }
+
+        ConcurrentIngestion *ingestion_;
+        ValueBuffer buffer_;
+        size_t buffer_filled_;
+        std::vector<std::string> run_file_names_;
+    };
+
+    // Block of parameters.block_size bytes is split between producers_count producers
+    ConcurrentIngestion(std::string temp_file_name_mask, const SortParameters &parameters, int producers_count) :
+        temp_file_name_mask_(temp_file_name_mask),
+        parameters_(parameters),
+        producer_buffer_size_(parameters.block_size / std::max(1, producers_count) / sizeof(uint64_t)),
+        next_run_number_(0)
+    {}
+
+    ~ConcurrentIngestion() {
+        for (const std::unique_ptr<Producer> &producer: producers_) {
+            for (std::string run_file_name: producer->run_file_names_) {
+                ::remove(run_file_name.c_str());
+            }
+        }
+    }
+
+    // Returns a new producer, which lives as long as the ingestion
+    Producer *CreateProducer() {
+        std::lock_guard<std::mutex> lock(producers_mutex_);
+        producers_.emplace_back(new Producer(this, producer_buffer_size_));
+        return producers_.back().get();
+    }
+
+    // Merges values of all producers into output file
+    // Must be called after all producer threads are done
+    void Finish(std::string output_file_name) {
+        std::vector<std::string> run_file_names;
+        for (const std::unique_ptr<Producer> &producer: producers_) {
+            producer->Close();
+            run_file_names.insert(run_file_names.end(), producer->run_file_names_.begin(), producer->run_file_names_.end());
+            producer->run_file_names_.clear();
+        }
+
+        std::vector<std::string> merged_file_names = ReduceRuns(run_file_names, temp_file_name_mask_ + "_m", parameters_);
+        MergeFiles(merged_file_names, output_file_name, parameters_);
+        for (std::string run_file_name: merged_file_names) {
+            AnonymousFiles::Remove(run_file_name);
+        }
+    }
+
+private:
+    std::string temp_file_name_mask_;
+    SortParameters parameters_;
+    long long producer_buffer_size_;
+    std::atomic<long long> next_run_number_;
+    std::mutex producers_mutex_;
+    std::vector<std::unique_ptr<Producer>> producers_;
+};
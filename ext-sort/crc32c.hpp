@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#define HAS_CRC32C_INSTRUCTION
+#endif
+
+namespace algorithms {
+
+// CRC32C (Castagnoli polynomial), the one computed by SSE4.2 crc32 instruction
+const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+struct Crc32cTable {
+    uint32_t values[256];
+
+    Crc32cTable() {
+        for (uint32_t byte = 0; byte < 256; ++byte) {
+            uint32_t value = byte;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? (value >> 1) ^ CRC32C_POLYNOMIAL : value >> 1;
+            }
+            values[byte] = value;
+        }
+    }
+};
+
+// Software implementation, used when processor doesn't support SSE4.2
+inline uint32_t Crc32cSoftware(uint32_t crc, const unsigned char *data, size_t size) {
+    static const Crc32cTable table;
+    for (size_t idx = 0; idx < size; ++idx) {
+        crc = table.values[(crc ^ data[idx]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAS_CRC32C_INSTRUCTION
+__attribute__((target("sse4.2")))
+inline uint32_t Crc32cHardware(uint32_t crc, const unsigned char *data, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; size > 0; --size, ++data) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+// Returns CRC32C checksum of data appended to data with checksum crc
+// Checksum of empty data is 0
+inline uint32_t Crc32c(uint32_t crc, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    crc = ~crc;
+#ifdef HAS_CRC32C_INSTRUCTION
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return ~Crc32cHardware(crc, bytes, size);
+    }
+#endif
+    return ~Crc32cSoftware(crc, bytes, size);
+}
+
+} // namespace algorithms
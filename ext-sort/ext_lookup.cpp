@@ -0,0 +1,45 @@
+// Looks up values in a file sorted by ext_sort with --index_interval.
+// Prints index of the first value not less than the key and that value,
+// or all values in range [key, end) with --end.
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <tclap/CmdLine.h>
+#include "sparse_index.hpp"
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Lookups in a sorted file with sparse index", ' ', "1.0");
+        TCLAP::ValueArg<unsigned long> key_arg("k", "key", "Value to look for", true, 0, "integer");
+        TCLAP::ValueArg<unsigned long> end_arg("e", "end", "Print all values not less than key and less than this value", false, 0, "integer");
+        TCLAP::UnlabeledValueArg<std::string> sorted_file_arg("sorted_file", "Sorted file name, index is read from sorted_file.idx", true, "", "nameString");
+        cmd.add(key_arg);
+        cmd.add(end_arg);
+        cmd.add(sorted_file_arg);
+        cmd.parse(argc, argv);
+
+        IndexedSortedFile sorted_file(sorted_file_arg.getValue());
+        uint64_t begin = sorted_file.LowerBound(key_arg.getValue());
+
+        if (!end_arg.isSet()) {
+            std::cout << begin;
+            if (begin < sorted_file.GetSize()) {
+                std::cout << " " << sorted_file.GetValue(begin);
+            }
+            std::cout << std::endl;
+        } else {
+            uint64_t end = sorted_file.LowerBound(end_arg.getValue());
+            for (uint64_t index = begin; index < end; ++index) {
+                std::cout << sorted_file.GetValue(index) << "\n";
+            }
+        }
+    } catch (TCLAP::ArgException &arg) {
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        return 1;
+    } catch (std::runtime_error& err) {
+        std::cerr << "Runtime error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Keeps a sorted store up to date under appended batches of values, see lsm_store.hpp.
+// add sorts a batch file into the store, compact merges the whole store into one run,
+// export writes all values of the store into one sorted file.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <tclap/CmdLine.h>
+#include "lsm_store.hpp"
+
+const int DEFAULT_BLOCK_SIZE = 1024 * 1024 * 1024; // 1 GB
+const int DEFAULT_BRANCHING_DEGREE = 8;
+const int DEFAULT_JOBS = 1;
+const std::string ADD_COMMAND = "add";
+const std::string COMPACT_COMMAND = "compact";
+const std::string EXPORT_COMMAND = "export";
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Sorted store under appends", ' ', "1.0");
+        std::vector<std::string> commands {ADD_COMMAND, COMPACT_COMMAND, EXPORT_COMMAND};
+        TCLAP::ValuesConstraint<std::string> command_constraint(commands);
+        TCLAP::UnlabeledValueArg<std::string> command_arg("command", "Command to run", true, ADD_COMMAND, &command_constraint);
+        TCLAP::UnlabeledValueArg<std::string> store_arg("store", "Store directory", true, "", "nameString");
+        TCLAP::UnlabeledValueArg<std::string> file_arg("file", "Batch file to add, or output file to export into", false, "", "nameString");
+        TCLAP::ValueArg<int> block_size_arg("b", "block_size", "Size of one block to use (in bytes)", false, DEFAULT_BLOCK_SIZE, "integer");
+        TCLAP::ValueArg<int> branching_degree_arg("d", "branching", "Branching degree, also number of runs which triggers compaction of a level", false, DEFAULT_BRANCHING_DEGREE, "integer");
+        TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of sorts and merges to run at the same time", false, DEFAULT_JOBS, "integer");
+        cmd.add(block_size_arg);
+        cmd.add(branching_degree_arg);
+        cmd.add(jobs_arg);
+        cmd.add(command_arg);
+        cmd.add(store_arg);
+        cmd.add(file_arg);
+        cmd.parse(argc, argv);
+
+        std::string command = command_arg.getValue();
+        if (command != COMPACT_COMMAND && file_arg.getValue().empty()) {
+            throw std::runtime_error("Command " + command + " needs a file name");
+        }
+        if (branching_degree_arg.getValue() < 2 || jobs_arg.getValue() < 1) {
+            throw std::runtime_error("Branching degree must be at least 2, number of jobs must be positive");
+        }
+
+        SortParameters parameters {block_size_arg.getValue(), branching_degree_arg.getValue(), NO_LIMIT, jobs_arg.getValue(), NO_DEVICE_JOBS_LIMIT, false, false, 1, NO_INDEX, false, false, nullptr, false};
+        LsmStore store(store_arg.getValue(), parameters);
+        if (command == ADD_COMMAND) {
+            store.AddBatch(file_arg.getValue());
+        } else if (command == COMPACT_COMMAND) {
+            store.CompactAll();
+        } else {
+            store.Export(file_arg.getValue());
+        }
+
+        std::vector<int> level_sizes = store.GetLevelSizes();
+        std::cerr << "Runs per level:";
+        for (int level_size: level_sizes) {
+            std::cerr << " " << level_size;
+        }
+        std::cerr << std::endl;
+    } catch (TCLAP::ArgException &arg) {
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        return 1;
+    } catch (std::runtime_error& err) {
+        std::cerr << "Runtime error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+// Merges sorted binary files into one sorted output file, like sort -m.
+// All inputs are merged in one pass, with -j the output is split into ranges merged at the same time.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <tclap/CmdLine.h>
+#include "external_sort.hpp"
+
+const int DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024; // 64 MB
+const int DEFAULT_JOBS = 1;
+
+int main(int argc, char **argv) {
+    std::ios_base::sync_with_stdio(false);
+    try {
+        TCLAP::CmdLine cmd("Merging sorted binary files", ' ', "1.0");
+        TCLAP::ValueArg<int> block_size_arg("b", "block_size", "Size of memory for read buffers (in bytes)", false, DEFAULT_BLOCK_SIZE, "integer");
+        TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of ranges of output to merge at the same time", false, DEFAULT_JOBS, "integer");
+        TCLAP::SwitchArg check_sorted_arg("c", "check_sorted", "Check that every input is sorted, fail otherwise", false);
+        TCLAP::UnlabeledValueArg<std::string> output_file_arg("output_file", "Output file name, - for standard output", true, "", "nameString");
+        TCLAP::UnlabeledMultiArg<std::string> input_files_arg("input_files", "Sorted input file names", true, "nameString");
+        cmd.add(block_size_arg);
+        cmd.add(jobs_arg);
+        cmd.add(check_sorted_arg);
+        cmd.add(output_file_arg);
+        cmd.add(input_files_arg);
+        cmd.parse(argc, argv);
+
+        if (jobs_arg.getValue() < 1) {
+            throw std::runtime_error("Number of jobs must be positive");
+        }
+        SortParameters parameters {block_size_arg.getValue(), 0, NO_LIMIT, jobs_arg.getValue(), NO_DEVICE_JOBS_LIMIT, false, false, 1, NO_INDEX, false, false, nullptr, false};
+        MergeFiles(input_files_arg.getValue(), output_file_arg.getValue(), parameters,
+                   check_sorted_arg.getValue() ? CHECKED_SORTED_VALUES : SORTED_VALUES);
+    } catch (TCLAP::ArgException &arg) {
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        return 1;
+    } catch (std::runtime_error& err) {
+        std::cerr << "Runtime error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Computes set operations over sorted binary files in one merging pass.
+// union, intersection and difference (first input minus all others) write distinct values,
+// or, with --all, every value as many times as it occurs in the result multiset.
+// join writes pairs of 64bit values: key present in all inputs and product of its counts in the inputs.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <tclap/CmdLine.h>
+#include "key_merger.hpp"
+
+const int DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024; // 64 MB
+const std::string UNION_OPERATION = "union";
+const std::string INTERSECTION_OPERATION = "intersection";
+const std::string DIFFERENCE_OPERATION = "difference";
+const std::string JOIN_OPERATION = "join";
+
+// Returns how many times key with counts in the inputs occurs in result of the operation
+uint64_t GetResultCount(std::string operation, const std::vector<uint64_t> &counts, bool all) {
+    uint64_t min_count = *std::min_element(counts.begin(), counts.end());
+    uint64_t counts_sum = 0;
+    for (uint64_t count: counts) {
+        counts_sum += count;
+    }
+
+    if (operation == UNION_OPERATION) {
+        return all ? counts_sum : 1;
+    } else if (operation == INTERSECTION_OPERATION) {
+        return all ? min_count : std::min<uint64_t>(min_count, 1);
+    }
+    // difference
+    uint64_t other_counts_sum = counts_sum - counts[0];
+    if (all) {
+        return counts[0] > other_counts_sum ? counts[0] - other_counts_sum : 0;
+    }
+    return (counts[0] > 0 && other_counts_sum == 0) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Set operations over sorted binary files", ' ', "1.0");
+        std::vector<std::string> operations {UNION_OPERATION, INTERSECTION_OPERATION, DIFFERENCE_OPERATION, JOIN_OPERATION};
+        TCLAP::ValuesConstraint<std::string> operation_constraint(operations);
+        TCLAP::UnlabeledValueArg<std::string> operation_arg("operation", "Operation to compute", true, UNION_OPERATION, &operation_constraint);
+        TCLAP::UnlabeledValueArg<std::string> output_file_arg("output_file", "Output file name, - for standard output", true, "", "nameString");
+        TCLAP::UnlabeledMultiArg<std::string> input_files_arg("input_files", "Sorted input file names", true, "nameString");
+        TCLAP::ValueArg<int> block_size_arg("b", "block_size", "Size of memory for read buffers (in bytes)", false, DEFAULT_BLOCK_SIZE, "integer");
+        TCLAP::SwitchArg all_arg("a", "all", "Keep duplicates, treating inputs as multisets", false);
+        cmd.add(block_size_arg);
+        cmd.add(all_arg);
+        cmd.add(operation_arg);
+        cmd.add(output_file_arg);
+        cmd.add(input_files_arg);
+        cmd.parse(argc, argv);
+
+        std::string operation = operation_arg.getValue();
+        std::vector<std::string> input_files = input_files_arg.getValue();
+        long long buffer_size = GetMergeBufferSize(block_size_arg.getValue(), input_files.size());
+
+        std::vector<std::unique_ptr<RunReader>> runs;
+        std::vector<RunReader *> run_pointers;
+        for (std::string file_name: input_files) {
+            runs.emplace_back(new RunReader(file_name, buffer_size, false, SORTED_VALUES));
+            run_pointers.push_back(runs.back().get());
+        }
+
+        KeyMerger merger(run_pointers);
+        RunWriter out_file(output_file_arg.getValue(), false);
+        while (merger.Next()) {
+            const std::vector<uint64_t> &counts = merger.GetCounts();
+            if (operation == JOIN_OPERATION) {
+                if (std::find(counts.begin(), counts.end(), 0) == counts.end()) {
+                    uint64_t product = 1;
+                    for (uint64_t count: counts) {
+                        product *= count;
+                    }
+                    out_file.Write(merger.GetKey());
+                    out_file.Write(product);
+                }
+                continue;
+            }
+
+            uint64_t result_count = GetResultCount(operation, counts, all_arg.getValue());
+            for (uint64_t idx = 0; idx < result_count; ++idx) {
+                out_file.Write(merger.GetKey());
+            }
+        }
+        out_file.Close();
+    } catch (TCLAP::ArgException &arg) {
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        return 1;
+    } catch (std::runtime_error& err) {
+        std::cerr << "Runtime error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
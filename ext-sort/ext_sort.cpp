@@ -1,22 +1,27 @@
-// #define OLD_GCC
-
-#include <fstream>
 #include <stdexcept>
-
-#ifdef OLD_GCC
-#include <tr1/memory>
-#endif
+#include <iostream>
 #include <vector>
+#include <random>
+#include <fstream>
+#include <memory>
 #include <tclap/CmdLine.h>
-#include "binary_heap.hpp"
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <math.h>
-#include <cstdio>
+#include "external_sort.hpp"
+#include "memory_governor.hpp"
+#include "sort_service.hpp"
+#include "sharded_sort.hpp"
+#include "progress_reporter.hpp"
 
 const int DEFAULT_BLOCK_SIZE = 1024 * 1024 * 1024; // 1 GB
 const int DEFAULT_BRANCHING_DEGREE = 8;
+const int DEFAULT_JOBS = 1;
+const int DEFAULT_OUTPUT_PARTITIONS = 1;
+const int DEFAULT_SHARDS = 1;
+const long long NO_MEMORY_CAP = 0;
+const double NO_PROGRESS = 0;
+const std::string MERGE_ENGINE = "merge";
+const std::string DISTRIBUTION_ENGINE = "distribution";
+const std::string FUNNEL_ENGINE = "funnel";
+const std::string SHUFFLE_ENGINE = "shuffle";
 
 // Structure to hold command line arguments
 struct CliArguments {
@@ -24,48 +29,158 @@ struct CliArguments {
     std::string output_file;
     long long block_size;
     int branching_degree;
+    long long limit;
+    std::string engine;
+    int jobs;
+    int device_jobs;
+    bool verify;
+    int output_partitions;
+    long long index_interval;
+    bool resume;
+    bool numa;
+    long long memory;
+    bool adapt_memory;
+    std::string service;
+    int shards;
+    double progress;
+    std::string progress_json;
+    uint64_t seed;
 
     void CheckOrDie() const {
+        if (memory < 0) {
+            throw std::runtime_error("Memory cap must be non-negative");
+        }
+        if (memory != NO_MEMORY_CAP && block_size + GetBuffersSize(jobs) > memory) {
+            throw std::runtime_error("Block and write buffers of jobs don't fit into memory cap");
+        }
         const long long GB32 = 34359738368LU;
         if (block_size % 4 != 0 ||
             block_size < 4 ||
             block_size > GB32) {
             throw std::runtime_error("Block size must be in range [4 B; 32 GB]");
         }
+        if (limit < NO_LIMIT) {
+            throw std::runtime_error("Limit must be non-negative");
+        }
+        if (input_file == STANDARD_STREAM_NAME && engine != MERGE_ENGINE) {
+            throw std::runtime_error("Only merge engine can sort standard input");
+        }
+        if (index_interval != NO_INDEX && engine == SHUFFLE_ENGINE) {
+            throw std::runtime_error("Shuffled output can't have sparse index");
+        }
+        if (output_file == STANDARD_STREAM_NAME && engine == FUNNEL_ENGINE) {
+            throw std::runtime_error("Funnel engine can't write to standard output");
+        }
+        if (jobs < 1 || device_jobs < 0) {
+            throw std::runtime_error("Number of jobs must be positive");
+        }
+        if (output_partitions < 1) {
+            throw std::runtime_error("Number of output partitions must be positive");
+        }
+        if (output_partitions > 1 &&
+            (engine != MERGE_ENGINE || output_file == STANDARD_STREAM_NAME || limit != NO_LIMIT || verify)) {
+            throw std::runtime_error("Output partitions are written only by merge engine into files, without limit and verification");
+        }
+        if (index_interval < 0) {
+            throw std::runtime_error("Index interval must be non-negative");
+        }
+        if (index_interval != NO_INDEX && (engine == FUNNEL_ENGINE || output_file == STANDARD_STREAM_NAME)) {
+            throw std::runtime_error("Sparse index can't be written by funnel engine or for standard output");
+        }
+        if (resume && (engine != MERGE_ENGINE || input_file == STANDARD_STREAM_NAME)) {
+            throw std::runtime_error("Only merge engine can resume sorting, and only of a file");
+        }
+        if (memory != NO_MEMORY_CAP && engine != MERGE_ENGINE) {
+            // other engines hold a block for every level of their recursion, and funnels allocate buffers outside of the arena
+            throw std::runtime_error("Only merge engine can sort within memory cap");
+        }
+        if (adapt_memory && (engine != MERGE_ENGINE || memory != NO_MEMORY_CAP)) {
+            throw std::runtime_error("Only merge engine can adapt memory use, and not within memory cap");
+        }
+        if (!service.empty() &&
+            (engine != MERGE_ENGINE || input_file == STANDARD_STREAM_NAME || output_file == STANDARD_STREAM_NAME ||
+             device_jobs != NO_DEVICE_JOBS_LIMIT || output_partitions > 1 || index_interval != NO_INDEX ||
+             resume || numa || memory != NO_MEMORY_CAP || adapt_memory)) {
+            throw std::runtime_error("Sort service runs only merge sorts of files, with block size, branching, limit, jobs and verification");
+        }
+        if (shards < 1) {
+            throw std::runtime_error("Number of shards must be positive");
+        }
+        if (shards > 1 &&
+            (engine != MERGE_ENGINE || input_file == STANDARD_STREAM_NAME || output_file == STANDARD_STREAM_NAME ||
+             limit != NO_LIMIT || verify || output_partitions > 1 || index_interval != NO_INDEX ||
+             resume || numa || memory != NO_MEMORY_CAP || adapt_memory || !service.empty())) {
+            throw std::runtime_error("Shards run only merge sorts of files, without limit, verification, partitions, index and memory options");
+        }
+        if (numa && (engine != MERGE_ENGINE || resume)) {
+            throw std::runtime_error("Only merge engine can sort on NUMA nodes, and not when resuming");
+        }
+        if (progress < 0 || (!progress_json.empty() && progress == NO_PROGRESS)) {
+            throw std::runtime_error("Progress interval must be positive, JSON progress needs an interval");
+        }
+        if (progress != NO_PROGRESS && (engine != MERGE_ENGINE || !service.empty() || shards > 1)) {
+            throw std::runtime_error("Progress is reported only by merge engine, without service and shards");
+        }
+    }
+
+    SortParameters GetSortParameters() const {
+        return SortParameters {block_size, branching_degree, limit, jobs, device_jobs, verify, false, output_partitions, index_interval, resume, numa, nullptr, false};
     }
 };
 // Parses command line arguments from input
 // Returns structure with extracted arguments
 CliArguments ParseCliArguments(int argc, char **argv);
-// Sorts file with name input_file and writes result into file with name output_file
-// Assumes input file and output file are binary
-// Block size is maximum file size which can be loaded into RAM
-// Branching is maximum number of splits per file
-void ExternalMergeSort(std::string input_file, std::string output_file, long long block_size, int branching);
-// Splits a file into a sequence of sorted files
-// Sorting is performed sequentially (not parallel),
-// because it's assumed that only block of size block_size fits into memory
-// Returns vector with filenames, that store sorted files
-std::vector<std::string> SplitFileIntoSortedFiles(std::string input_file_name, std::string temp_file_name_mask, long long block_size, int branching);
-// Merges files into one big file
-// Input is in input_file_names, output is in output_file_name
-void MergeFiles(const std::vector<std::string> &input_file_names, std::string output_file_name);
-// Utility function that returns file size
-long long GetFileSize(std::string filename);
-
-// Helper structure to merge files
-// Stores a pointer to file and last value read from that file
-struct MergeElement;
 
 int main(int argc, char **argv) {
+    std::ios_base::sync_with_stdio(false);
     try {
         CliArguments arguments = ParseCliArguments(argc, argv);
-        ExternalMergeSort(arguments.input_file, arguments.output_file, arguments.block_size, arguments.branching_degree);
+        if (!arguments.service.empty()) {
+            SortRequest request {arguments.input_file, arguments.output_file, arguments.block_size, arguments.branching_degree,
+                                 arguments.limit, arguments.jobs, arguments.verify};
+            SortWithService(arguments.service, request, &std::cerr);
+            return 0;
+        }
+        if (arguments.shards > 1) {
+            ShardedSort(arguments.input_file, arguments.output_file, arguments.GetSortParameters(), arguments.shards).Sort();
+            return 0;
+        }
+        if (arguments.memory != NO_MEMORY_CAP) {
+            MemoryArena::Create(arguments.memory);
+        }
+        if (arguments.adapt_memory) {
+            MemoryGovernor::Create();
+        }
+        // progress goes to standard error, since output may be standard output
+        std::unique_ptr<std::ofstream> progress_json;
+        std::unique_ptr<ProgressReporter> progress;
+        if (!arguments.progress_json.empty()) {
+            progress_json.reset(new std::ofstream(arguments.progress_json));
+            if (!*progress_json) {
+                throw std::runtime_error("Can't open progress file " + arguments.progress_json);
+            }
+        }
+        if (arguments.progress != NO_PROGRESS) {
+            long long input_size = (arguments.input_file == STANDARD_STREAM_NAME ? -1 : GetFileSize(arguments.input_file));
+            progress.reset(new ProgressReporter(input_size, arguments.progress, progress_json ? nullptr : &std::cerr, progress_json.get()));
+        }
+        if (arguments.engine == DISTRIBUTION_ENGINE) {
+            ExternalDistributionSort(arguments.input_file, arguments.output_file, arguments.GetSortParameters());
+        } else if (arguments.engine == SHUFFLE_ENGINE) {
+            ExternalShuffle(arguments.input_file, arguments.output_file, arguments.GetSortParameters(), arguments.seed);
+        } else if (arguments.engine == FUNNEL_ENGINE) {
+            FunnelSortFile(arguments.input_file, arguments.output_file, arguments.limit);
+        } else {
+            SortParameters parameters = arguments.GetSortParameters();
+            parameters.observer = progress.get();
+            ExternalMergeSort(arguments.input_file, arguments.output_file, parameters);
+        }
     } catch (TCLAP::ArgException &arg) {
-        std::cout << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
         return 1;
     } catch (std::runtime_error& err) {
-        std::cout << "Runtime error: " << err.what() << std::endl;
+        // output may be standard output, so errors go to standard error
+        std::cerr << "Runtime error: " << err.what() << std::endl;
         return 1;
     }
 
@@ -73,161 +188,50 @@ int main(int argc, char **argv) {
 }
 
 
-// A pointer to std::ifstream object (needed to store them in a container)
-#ifdef OLD_GCC
-typedef std::tr1::shared_ptr<std::ifstream> FilePointer;
-#else
-typedef std::shared_ptr<std::ifstream> FilePointer;
-#endif
-
-
-struct MergeElement {
-    std::vector<FilePointer>::iterator file_iterator_;
-    uint64_t value_;
-
-public:
-    MergeElement(std::vector<FilePointer>::iterator file_iterator) :
-        file_iterator_(file_iterator)
-    {
-        ReadNextValue();
-    }
-
-    bool operator < (const MergeElement &other) {
-        return (value_ < other.value_);
-    }
-
-    bool operator > (const MergeElement &other) const {
-        return (value_ > other.value_);
-    }
-
-    void ReadNextValue() {
-        (*file_iterator_)->read((char *) &value_, sizeof(value_));
-    }
-
-    uint64_t GetValue() const {
-        return value_;
-    }
-
-    bool Stop() const {
-        return !(**file_iterator_);
-    }
-};
-
-
-void MergeFiles(const std::vector<std::string> &input_file_names, std::string output_file_name) {
-    algorithms::BinaryHeap<MergeElement, std::greater<MergeElement>> merge_elements;
-
-    std::vector<FilePointer> in_files;
-    for (std::string file_name: input_file_names) {
-        in_files.push_back(FilePointer(new std::ifstream(file_name, std::ios_base::in | std::ios_base::binary)));
-    }
-    std::ofstream out_file(output_file_name, std::ios_base::out | std::ios_base::binary);
-
-    for (auto file_iter = in_files.begin(); file_iter != in_files.end(); ++file_iter) {
-        merge_elements.Insert(MergeElement(file_iter));
-    }
-
-    while (merge_elements.GetSize() > 0) {
-        MergeElement minimum = merge_elements.GetTop();
-        merge_elements.Pop();
-
-        uint64_t value = minimum.GetValue();
-        out_file.write((char *) &value, sizeof(value));
-
-        minimum.ReadNextValue();
-        if (!minimum.Stop()) {
-            merge_elements.Insert(minimum);
-        }
-    }
-
-    out_file.flush();
-}
-
-
-long long GetFileSize(std::string filename) {
-    struct stat stat_buf;
-    int rc = stat(filename.c_str(), &stat_buf);
-    return rc == 0 ? stat_buf.st_size : -1;
-}
-
-
-std::vector<std::string> SplitFileIntoSortedFiles(std::string input_file_name, std::string temp_file_name_mask, long long block_size, int branching_degree) {
-    long long file_size = GetFileSize(input_file_name);
-
-    int chunk_size = ceil(double(file_size) / branching_degree) - (int(ceil(double(file_size) / branching_degree)) % 4);
-
-    std::vector<std::string> sorted_file_names;
-    std::ifstream in_file(input_file_name, std::ios_base::in | std::ios_base::binary);
-    std::vector<uint64_t> buffer(block_size / sizeof(uint64_t), 0);
-    int file_name_number = 0;
-
-    if (chunk_size <= block_size) {
-        // can do in one pass
-
-        while (in_file) {
-            in_file.read((char *) &buffer[0], block_size);
-            size_t bytes_read = in_file.gcount();
-            if (bytes_read < sizeof(uint64_t)) {
-                break;
-            }
-            std::sort(buffer.begin(), buffer.begin() + (bytes_read / sizeof(uint64_t)));
-
-            std::string temp_file_name = temp_file_name_mask + std::to_string(file_name_number++);
-            sorted_file_names.push_back(temp_file_name);
-
-            std::ofstream out_file(temp_file_name, std::ios_base::out | std::ios_base::binary);
-            out_file.write((char *) &buffer[0], bytes_read);
-            out_file.flush();
-        }
-    } else {
-        // need multiple passes
-        std::vector<std::string> temp_file_names;
-        // split input file into chunks
-        while (in_file) {
-            std::string temp_file_name = temp_file_name_mask + std::to_string(file_name_number++);
-            std::ofstream chunk_file(temp_file_name, std::ios_base::out | std::ios_base::binary);
-
-            int chunk_filled = 0;
-            while (chunk_size - chunk_filled > block_size) {
-                in_file.read((char *) &buffer[0], block_size);
-                size_t bytes_read = in_file.gcount();
-                if (bytes_read < sizeof(uint64_t)) {
-                    break;
-                }
-
-                chunk_file.write((char *) &buffer[0], bytes_read);
-                chunk_filled += bytes_read;
-            }
-
-            if (chunk_filled > 0) {
-                temp_file_names.push_back(temp_file_name);
-                sorted_file_names.push_back(temp_file_name + "_s");
-                chunk_file.flush();
-            }
-        }
-
-        for (size_t file_name_idx = 0; file_name_idx < temp_file_names.size(); ++file_name_idx) {
-            ExternalMergeSort(temp_file_names[file_name_idx], sorted_file_names[file_name_idx], block_size, branching_degree);
-        }
-
-        for (std::string temp_file: temp_file_names) {
-            ::remove(temp_file.c_str());
-        }
-    }
-    return sorted_file_names;
-}
-
-
 CliArguments ParseCliArguments(int argc, char **argv) {
     TCLAP::CmdLine cmd("Sorting in external memory", ' ', "1.0");
     TCLAP::ValueArg<int> block_size_arg("b", "block_size", "Size of one block to use (in bytes)", false, DEFAULT_BLOCK_SIZE, "integer");
     TCLAP::ValueArg<int> branching_degree_arg("d", "branching", "Branching degree", false, DEFAULT_BRANCHING_DEGREE, "integer");
-    TCLAP::UnlabeledValueArg<std::string> input_file_arg( "input_file", "Input file name", true, "", "nameString");
-    TCLAP::UnlabeledValueArg<std::string> output_file_arg( "output_file", "Output file name", true, "", "nameString");
+    TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of recursive sorts to run at the same time", false, DEFAULT_JOBS, "integer");
+    TCLAP::ValueArg<int> device_jobs_arg("", "device_jobs", "Number of recursive sorts to run at the same time on one device, 0 for no limit", false, NO_DEVICE_JOBS_LIMIT, "integer");
+    TCLAP::SwitchArg verify_arg("", "verify", "Check checksums of sorted runs while merging them", false);
+    TCLAP::ValueArg<int> output_partitions_arg("", "output_partitions", "Split output into this number of files with contiguous ranges of values", false, DEFAULT_OUTPUT_PARTITIONS, "integer");
+    TCLAP::ValueArg<long> index_interval_arg("", "index_interval", "Write sparse index with every this-th value into output_file.idx, 0 for no index", false, NO_INDEX, "integer");
+    TCLAP::SwitchArg resume_arg("", "resume", "Record completed runs, and continue sort interrupted after a run with this option was recorded", false);
+    TCLAP::SwitchArg numa_arg("", "numa", "Form runs and merge ranges with threads pinned to NUMA nodes, every one with its part of the block on its node", false);
+    TCLAP::ValueArg<long> memory_arg("", "memory", "Allocate all buffers from one arena of this size (in bytes), block size defaults to what fits into it", false, NO_MEMORY_CAP, "integer");
+    TCLAP::SwitchArg adapt_memory_arg("", "adapt_memory", "Shrink runs and merge buffers when memory pressure of the cgroup is high, and grow them back when memory frees up", false);
+    TCLAP::ValueArg<std::string> service_arg("", "service", "Run the sort in ext_sortd listening on this socket, which shares memory and devices between sorts", false, "", "nameString");
+    TCLAP::ValueArg<int> shards_arg("", "shards", "Split the sort between this number of worker processes, which exchange ranges of values over sockets", false, DEFAULT_SHARDS, "integer");
+    TCLAP::ValueArg<double> progress_arg("", "progress", "Report bytes, rates, runs and ETA of the sort every this number of seconds, 0 for no reports", false, NO_PROGRESS, "seconds");
+    TCLAP::ValueArg<std::string> progress_json_arg("", "progress_json", "Write progress reports as JSON lines into this file instead of standard error", false, "", "nameString");
+    TCLAP::ValueArg<unsigned long> seed_arg("", "seed", "Seed of random order of shuffle engine, random if not set", false, 0, "integer");
+    TCLAP::ValueArg<long> limit_arg("l", "limit", "Write only this number of smallest values", false, NO_LIMIT, "integer");
+    std::vector<std::string> engines {MERGE_ENGINE, DISTRIBUTION_ENGINE, FUNNEL_ENGINE, SHUFFLE_ENGINE};
+    TCLAP::ValuesConstraint<std::string> engine_constraint(engines);
+    TCLAP::ValueArg<std::string> engine_arg("e", "engine", "Sorting algorithm to use, shuffle writes values in random order instead", false, MERGE_ENGINE, &engine_constraint);
+    TCLAP::UnlabeledValueArg<std::string> input_file_arg( "input_file", "Input file name, - for standard input", true, "", "nameString");
+    TCLAP::UnlabeledValueArg<std::string> output_file_arg( "output_file", "Output file name, - for standard output", true, "", "nameString");
     cmd.add(input_file_arg);
     cmd.add(output_file_arg);
     cmd.add(block_size_arg);
     cmd.add(branching_degree_arg);
+    cmd.add(limit_arg);
+    cmd.add(engine_arg);
+    cmd.add(jobs_arg);
+    cmd.add(device_jobs_arg);
+    cmd.add(verify_arg);
+    cmd.add(output_partitions_arg);
+    cmd.add(index_interval_arg);
+    cmd.add(resume_arg);
+    cmd.add(numa_arg);
+    cmd.add(memory_arg);
+    cmd.add(adapt_memory_arg);
+    cmd.add(service_arg);
+    cmd.add(shards_arg);
+    cmd.add(progress_arg);
+    cmd.add(progress_json_arg);
+    cmd.add(seed_arg);
 
     cmd.parse(argc, argv);
 
@@ -235,20 +239,28 @@ CliArguments ParseCliArguments(int argc, char **argv) {
         input_file_arg.getValue(),
         output_file_arg.getValue(),
         block_size_arg.getValue(),
-        branching_degree_arg.getValue()
+        branching_degree_arg.getValue(),
+        limit_arg.getValue(),
+        engine_arg.getValue(),
+        jobs_arg.getValue(),
+        device_jobs_arg.getValue(),
+        verify_arg.getValue(),
+        output_partitions_arg.getValue(),
+        index_interval_arg.getValue(),
+        resume_arg.getValue(),
+        numa_arg.getValue(),
+        memory_arg.getValue(),
+        adapt_memory_arg.getValue(),
+        service_arg.getValue(),
+        shards_arg.getValue(),
+        progress_arg.getValue(),
+        progress_json_arg.getValue(),
+        seed_arg.isSet() ? seed_arg.getValue() : std::random_device()()
     };
+    if (arguments.memory != NO_MEMORY_CAP && !block_size_arg.isSet()) {
+        arguments.block_size = std::max(0LL, arguments.memory - GetBuffersSize(arguments.jobs)) / sizeof(uint64_t) * sizeof(uint64_t);
+    }
     arguments.CheckOrDie();
 
     return arguments;
 }
-
-
-void ExternalMergeSort(std::string input_file, std::string output_file, long long block_size, int branching_degree) {
-    std::vector<std::string> temp_file_names = SplitFileIntoSortedFiles(input_file, input_file + "_tmp", block_size, branching_degree);
-    MergeFiles(temp_file_names, output_file);
-
-    // remove unnecessary files
-    for (std::string temp_file: temp_file_names) {
-        ::remove(temp_file.c_str());
-    }
-}
@@ -0,0 +1,69 @@
+// Sort service: runs sorts submitted with ext_sort --service over a Unix socket,
+// within one memory budget and limits on concurrent sorts and phases per device, see sort_service.hpp.
+// Socket is accessible to the user and the group of the service, files of sorts are opened with permissions of clients.
+#include <iostream>
+#include <string>
+#include <thread>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tclap/CmdLine.h>
+#include "sort_service.hpp"
+
+const long long DEFAULT_MEMORY_BUDGET = 4LL * 1024 * 1024 * 1024; // 4 GB
+const int DEFAULT_JOBS = 2;
+const int DEFAULT_DEVICE_PHASES = 2;
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Service running sorts of several clients within shared budgets", ' ', "1.0");
+        TCLAP::UnlabeledValueArg<std::string> socket_arg("socket", "Name of Unix socket to listen on", true, "", "nameString");
+        TCLAP::ValueArg<long> memory_arg("", "memory", "Memory budget of all sorts (in bytes), blocks of sorts are cut to fit into it", false, DEFAULT_MEMORY_BUDGET, "integer");
+        TCLAP::ValueArg<int> jobs_arg("j", "jobs", "Number of sorts to run at the same time", false, DEFAULT_JOBS, "integer");
+        TCLAP::ValueArg<int> device_phases_arg("", "device_phases", "Number of phases of sorts to run at the same time on one device", false, DEFAULT_DEVICE_PHASES, "integer");
+        cmd.add(memory_arg);
+        cmd.add(jobs_arg);
+        cmd.add(device_phases_arg);
+        cmd.add(socket_arg);
+        cmd.parse(argc, argv);
+
+        if (memory_arg.getValue() <= 0 || jobs_arg.getValue() < 1 || device_phases_arg.getValue() < 1) {
+            throw std::runtime_error("Memory budget, number of jobs and of device phases must be positive");
+        }
+        SortService service(memory_arg.getValue(), jobs_arg.getValue(), device_phases_arg.getValue());
+
+        std::string socket_name = socket_arg.getValue();
+        sockaddr_un address = GetSocketAddress(socket_name);
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        // socket left by a previous service is replaced
+        unlink(socket_name.c_str());
+        // socket is created with mode 0660, so that other users can't connect
+        mode_t old_umask = umask(S_IRWXO | S_IXUSR | S_IXGRP);
+        bool bound = (listener >= 0 && bind(listener, (sockaddr *) &address, sizeof(address)) == 0);
+        umask(old_umask);
+        if (!bound || chmod(socket_name.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) != 0 || listen(listener, SOMAXCONN) != 0) {
+            throw std::runtime_error("Can't listen on socket " + socket_name);
+        }
+
+        while (true) {
+            int connection = accept(listener, nullptr, nullptr);
+            if (connection < 0) {
+                continue;
+            }
+            std::thread([&service, connection] () {
+                service.Serve(connection);
+                close(connection);
+            }).detach();
+        }
+    } catch (TCLAP::ArgException &arg) {
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        return 1;
+    } catch (std::runtime_error& err) {
+        std::cerr << "Runtime error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
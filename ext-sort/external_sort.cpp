@@ -0,0 +1,1278 @@
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include "binary_heap.hpp"
+#include "funnel_sort.hpp"
+#include "external_sort.hpp"
+#include "sparse_index.hpp"
+#include "sort_manifest.hpp"
+#include "numa_topology.hpp"
+#include "memory_governor.hpp"
+#include "sort_observer.hpp"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <cstdio>
+#include <random>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+
+// Helper structure to merge runs
+// Stores a pointer to run and current value of that run
+struct MergeElement {
+    RunReader *run_;
+    uint64_t value_;
+
+public:
+    explicit MergeElement(RunReader *run) :
+        run_(run),
+        value_(run->GetValue())
+    {}
+
+    bool operator < (const MergeElement &other) const {
+        return (value_ < other.value_);
+    }
+
+    bool operator > (const MergeElement &other) const {
+        return (value_ > other.value_);
+    }
+
+    RunReader *GetRun() const {
+        return run_;
+    }
+
+    uint64_t GetValue() const {
+        return value_;
+    }
+};
+
+
+long long GetMergeMemorySize(long long block_size) {
+    return MemoryGovernor::Get() != nullptr ? MemoryGovernor::Get()->GetUsableSize(block_size) : block_size;
+}
+
+
+long long GetMergeBufferSize(long long block_size, size_t runs_count) {
+    long long buffer_size = block_size / (runs_count + 1);
+    buffer_size = std::max(MIN_MERGE_BUFFER_SIZE, std::min(READ_BUFFER_SIZE, buffer_size));
+    return buffer_size / sizeof(uint64_t);
+}
+
+
+size_t GallopUpperBound(const uint64_t *values, size_t count, uint64_t bound) {
+    size_t step = 1;
+    while (step < count && values[step] <= bound) {
+        step *= 2;
+    }
+    return std::upper_bound(values + step / 2, values + std::min(step, count), bound) - values;
+}
+
+
+void MergeRuns(const std::vector<RunReader *> &runs, RunWriter *out_file, long long *values_left) {
+    algorithms::BinaryHeap<MergeElement, std::greater<MergeElement>> merge_elements;
+    for (RunReader *run: runs) {
+        if (run->HasValue()) {
+            merge_elements.Insert(MergeElement(run));
+        }
+    }
+
+    while (merge_elements.GetSize() > 0 && *values_left > 0) {
+        RunReader *run = merge_elements.GetTop().GetRun();
+        uint64_t runner_up = (merge_elements.GetSize() > 1 ?
+                              merge_elements.GetNextTop().GetValue() :
+                              std::numeric_limits<uint64_t>::max());
+
+        // values of the run not greater than the runner-up go to output without touching the heap
+        while (run->HasValue() && *values_left > 0) {
+            const uint64_t *values = run->GetBufferedValues();
+            size_t count = std::min<long long>(run->GetBufferedCount(), *values_left);
+            size_t gallop_length = GallopUpperBound(values, count, runner_up);
+
+            if (gallop_length == 1) {
+                out_file->Write(values[0]);
+            } else {
+                out_file->Write(values, gallop_length);
+            }
+            run->Skip(gallop_length);
+            *values_left -= gallop_length;
+            if (gallop_length < count) {
+                break;
+            }
+        }
+
+        if (run->HasValue()) {
+            merge_elements.ReplaceTop(MergeElement(run));
+        } else {
+            merge_elements.Pop();
+        }
+    }
+}
+
+
+void MergeFiles(const std::vector<std::string> &input_file_names, std::string output_file_name, const SortParameters &parameters, RunFormat input_format) {
+    if (parameters.jobs > 1 && parameters.limit == NO_LIMIT && !parameters.verify && !parameters.output_footer &&
+        parameters.index_interval == NO_INDEX && output_file_name != STANDARD_STREAM_NAME) {
+        MergeFilesConcurrently(input_file_names, output_file_name, parameters, input_format);
+        return;
+    }
+
+    long long buffer_size = GetMergeBufferSize(GetMergeMemorySize(parameters.block_size), input_file_names.size());
+    std::vector<std::unique_ptr<RunReader>> runs;
+    for (std::string file_name: input_file_names) {
+        runs.emplace_back(new RunReader(file_name, buffer_size, parameters.verify, input_format));
+    }
+
+    std::vector<RunReader *> run_pointers;
+    for (const std::unique_ptr<RunReader> &run: runs) {
+        run_pointers.push_back(run.get());
+    }
+
+    long long values_count = 0;
+    for (RunReader *run: run_pointers) {
+        values_count += run->GetFooter().count;
+    }
+    long long values_left = (parameters.limit == NO_LIMIT ? std::numeric_limits<long long>::max() : parameters.limit);
+    values_count = std::min(values_count, values_left);
+
+    RunWriter out_file(output_file_name, parameters.output_footer, parameters.anonymous_output ? ANONYMOUS_FILE : NEW_FILE);
+    out_file.Preallocate(values_count * sizeof(uint64_t) + (parameters.output_footer ? sizeof(RunFooter) : 0));
+    AddSparseIndex(&out_file, output_file_name, parameters);
+    out_file.ReportProgress(parameters.observer, true);
+    MergeRunGroups(run_pointers, &out_file, &values_left);
+    out_file.Close();
+}
+
+
+void MergeRunGroups(std::vector<RunReader *> runs, RunWriter *out_file, long long *values_left) {
+    std::sort(runs.begin(), runs.end(), [] (const RunReader *one, const RunReader *other) {
+        return one->GetFooter().min_value < other->GetFooter().min_value;
+    });
+
+    size_t group_end = 0;
+    for (size_t group_begin = 0; group_begin < runs.size() && *values_left > 0; group_begin = group_end) {
+        std::vector<RunReader *> group {runs[group_begin]};
+        uint64_t group_max_value = runs[group_begin]->GetFooter().max_value;
+
+        for (group_end = group_begin + 1;
+             group_end < runs.size() && runs[group_end]->GetFooter().min_value < group_max_value;
+             ++group_end) {
+            group.push_back(runs[group_end]);
+            group_max_value = std::max(group_max_value, runs[group_end]->GetFooter().max_value);
+        }
+
+        MergeRuns(group, out_file, values_left);
+    }
+}
+
+
+std::vector<uint64_t> SampleRunSplitters(const std::vector<RunReader *> &runs, int partitions_count) {
+    return ChooseSplitters(SampleRuns(runs, partitions_count), partitions_count);
+}
+
+
+std::vector<std::pair<uint64_t, double>> SampleRuns(const std::vector<RunReader *> &runs, int partitions_count) {
+    // every sample stands for the values of its run up to the next sample
+    std::vector<std::pair<uint64_t, double>> samples;
+    for (RunReader *run: runs) {
+        uint64_t run_size = run->GetFooter().count;
+        uint64_t samples_count = std::min<uint64_t>(run_size, (uint64_t) partitions_count * SAMPLES_PER_BUCKET);
+        for (uint64_t sample = 0; sample < samples_count; ++sample) {
+            samples.push_back(std::make_pair(run->ReadValue(run_size * sample / samples_count), double(run_size) / samples_count));
+        }
+    }
+    return samples;
+}
+
+
+std::vector<uint64_t> ChooseSplitters(std::vector<std::pair<uint64_t, double>> samples, int partitions_count) {
+    double values_count = 0;
+    for (const std::pair<uint64_t, double> &sample: samples) {
+        values_count += sample.second;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    std::vector<uint64_t> splitters;
+    double values_before = 0;
+    size_t sample = 0;
+    for (int partition = 1; partition < partitions_count; ++partition) {
+        while (sample < samples.size() && values_before < values_count * partition / partitions_count) {
+            values_before += samples[sample++].second;
+        }
+        splitters.push_back(sample < samples.size() ? samples[sample].first : std::numeric_limits<uint64_t>::max());
+    }
+    return splitters;
+}
+
+
+std::string GetPartitionFileName(std::string output_file_name, int partition) {
+    return output_file_name + "." + std::to_string(partition);
+}
+
+
+void AddSparseIndex(RunWriter *out_file, std::string output_file_name, const SortParameters &parameters) {
+    if (parameters.index_interval != NO_INDEX) {
+        out_file->WriteSparseIndex(GetIndexFileName(output_file_name), parameters.index_interval);
+    }
+}
+
+
+std::vector<std::vector<uint64_t>> SplitRunsIntoRanges(const std::vector<std::string> &input_file_names, RunFormat input_format, int ranges_count) {
+    std::vector<std::unique_ptr<RunReader>> runs;
+    std::vector<RunReader *> run_pointers;
+    for (std::string file_name: input_file_names) {
+        runs.emplace_back(new RunReader(file_name, 1, false, input_format));
+        run_pointers.push_back(runs.back().get());
+    }
+
+    std::vector<uint64_t> splitters = SampleRunSplitters(run_pointers, ranges_count);
+    std::vector<std::vector<uint64_t>> run_bounds;
+    for (RunReader *run: run_pointers) {
+        std::vector<uint64_t> bounds {0};
+        for (uint64_t splitter: splitters) {
+            bounds.push_back(run->LowerBound(splitter));
+        }
+        bounds.push_back(run->GetFooter().count);
+        run_bounds.push_back(bounds);
+    }
+    return run_bounds;
+}
+
+
+void MergeRangesConcurrently(const std::vector<std::string> &input_file_names, RunFormat input_format, const std::vector<std::vector<uint64_t>> &run_bounds, int ranges_count, std::string output_file_name, bool single_output, const SortParameters &parameters) {
+    int jobs = std::max(1, std::min(parameters.jobs, ranges_count));
+    long long buffer_size = GetMergeBufferSize(GetMergeMemorySize(parameters.block_size) / jobs, input_file_names.size());
+
+    // range_offsets[range] is offset of the range in the single output file
+    std::vector<long long> range_offsets(ranges_count + 1, 0);
+    for (int range = 0; range < ranges_count; ++range) {
+        range_offsets[range + 1] = range_offsets[range];
+        for (const std::vector<uint64_t> &bounds: run_bounds) {
+            range_offsets[range + 1] += (bounds[range + 1] - bounds[range]) * sizeof(uint64_t);
+        }
+    }
+
+    std::atomic<int> next_range(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    NumaTopology topology;
+
+    // buffers of readers are allocated by the thread which merges the range, on its node
+    MemoryArena *arena = MemoryArena::Get();
+    auto merge_ranges = [&] (int job) {
+        MemoryArenaScope arena_scope(arena);
+        if (parameters.numa) {
+            topology.BindThread(job);
+        }
+        for (int range = next_range++; range < ranges_count && !failed; range = next_range++) {
+            try {
+                std::vector<std::unique_ptr<RunReader>> runs;
+                std::vector<RunReader *> run_pointers;
+                for (size_t run = 0; run < input_file_names.size(); ++run) {
+                    uint64_t range_begin = run_bounds[run][range];
+                    uint64_t range_end = run_bounds[run][range + 1];
+                    if (range_begin < range_end) {
+                        runs.emplace_back(new RunReader(input_file_names[run], buffer_size, false, input_format, range_begin, range_end));
+                        run_pointers.push_back(runs.back().get());
+                    }
+                }
+
+                std::unique_ptr<RunWriter> out_file;
+                if (single_output) {
+                    out_file.reset(new RunWriter(output_file_name, false, range_offsets[range]));
+                } else {
+                    std::string partition_file_name = GetPartitionFileName(output_file_name, range);
+                    out_file.reset(new RunWriter(partition_file_name, false));
+                    out_file->Preallocate(range_offsets[range + 1] - range_offsets[range]);
+                    AddSparseIndex(out_file.get(), partition_file_name, parameters);
+                }
+                out_file->ReportProgress(parameters.observer, true);
+                long long values_left = std::numeric_limits<long long>::max();
+                MergeRunGroups(run_pointers, out_file.get(), &values_left);
+                out_file->Close();
+                if (!single_output && parameters.observer != nullptr) {
+                    parameters.observer->AddRun();
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!failed) {
+                    error = std::current_exception();
+                    failed = true;
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int job = 0; job < jobs; ++job) {
+        threads.emplace_back(merge_ranges, job);
+    }
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+    if (failed) {
+        std::rethrow_exception(error);
+    }
+}
+
+
+void MergeFilesIntoPartitions(const std::vector<std::string> &input_file_names, std::string output_file_name, const SortParameters &parameters) {
+    std::vector<std::vector<uint64_t>> run_bounds = SplitRunsIntoRanges(input_file_names, RUN_WITH_FOOTER, parameters.output_partitions);
+    MergeRangesConcurrently(input_file_names, RUN_WITH_FOOTER, run_bounds, parameters.output_partitions, output_file_name, false, parameters);
+}
+
+
+void MergeFilesConcurrently(const std::vector<std::string> &input_file_names, std::string output_file_name, const SortParameters &parameters, RunFormat input_format) {
+    std::vector<std::vector<uint64_t>> run_bounds = SplitRunsIntoRanges(input_file_names, input_format, parameters.jobs);
+    long long output_size = 0;
+    for (const std::vector<uint64_t> &bounds: run_bounds) {
+        output_size += bounds.back() * sizeof(uint64_t);
+    }
+
+    CreateFileOfSize(output_file_name, output_size);
+    MergeRangesConcurrently(input_file_names, input_format, run_bounds, parameters.jobs, output_file_name, true, parameters);
+}
+
+
+void CreateFileOfSize(std::string file_name, long long size) {
+    int file_descriptor = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_descriptor < 0 || ftruncate(file_descriptor, size) != 0) {
+        if (file_descriptor >= 0) {
+            close(file_descriptor);
+        }
+        throw std::runtime_error("Can't create file " + file_name);
+    }
+    PreallocateFile(file_descriptor, 0, size);
+    close(file_descriptor);
+}
+
+
+long long GetFileSize(std::string filename) {
+    struct stat stat_buf;
+    int rc = stat(filename.c_str(), &stat_buf);
+    return rc == 0 ? stat_buf.st_size : -1;
+}
+
+
+std::vector<std::string> SplitFileIntoSortedFiles(std::string input_file_name, std::string temp_file_name_mask, const SortParameters &parameters, SortManifest *manifest) {
+    long long file_size = GetFileSize(input_file_name);
+
+    long long chunk_size = ceil(double(file_size) / parameters.branching_degree) - ((long long) ceil(double(file_size) / parameters.branching_degree)) % 4;
+    // input is read once to form runs of blocks, or twice when it is split into chunks which are sorted recursively,
+    // chunks are filled with whole blocks
+    bool one_pass = (chunk_size <= parameters.block_size);
+    long long run_input_size = (one_pass ? parameters.block_size : (chunk_size - 1) / parameters.block_size * parameters.block_size);
+    ObservedPhase form_runs(parameters.observer, SortPhase::FORM_RUNS, one_pass ? file_size : 2 * file_size,
+                            (file_size + run_input_size - 1) / run_input_size);
+
+    std::vector<std::string> sorted_file_names;
+    std::ifstream in_file(input_file_name, std::ios_base::in | std::ios_base::binary);
+    if (!in_file) {
+        throw std::runtime_error("Can't open input file " + input_file_name);
+    }
+    ReadBehind input_pages(input_file_name);
+
+    if (one_pass && parameters.numa && manifest == nullptr) {
+        // can do in one pass, every node sorts blocks in its own buffer
+        sorted_file_names = FormSortedRunsOnNodes(&in_file, &input_pages, temp_file_name_mask, parameters);
+    } else if (one_pass) {
+        // can do in one pass
+        ValueBuffer buffer(parameters.block_size / sizeof(uint64_t));
+        sorted_file_names = FormSortedRuns(&in_file, &input_pages, temp_file_name_mask, parameters, &buffer, manifest);
+    } else {
+        // need multiple passes
+        ValueBuffer buffer(parameters.block_size / sizeof(uint64_t));
+        std::vector<std::string> temp_file_names;
+        long long input_size = 0;
+        if (manifest != nullptr) {
+            // chunks written by the previous attempt
+            temp_file_names = manifest->GetChunks();
+            for (std::string temp_file_name: temp_file_names) {
+                sorted_file_names.push_back(temp_file_name + "_s");
+            }
+            input_size = manifest->GetChunkedInputSize();
+            in_file.seekg(input_size);
+            form_runs.AddProgress(input_size, input_size);
+        }
+        // split input file into chunks
+        for (int file_name_number = temp_file_names.size(); in_file; ++file_name_number) {
+            std::string temp_file_name = temp_file_name_mask + std::to_string(file_name_number);
+            RunWriter chunk_file(temp_file_name, false);
+            chunk_file.Preallocate(std::min(chunk_size, file_size - input_size));
+
+            long long chunk_filled = 0;
+            while (chunk_size - chunk_filled > parameters.block_size) {
+                in_file.read((char *) &buffer[0], parameters.block_size);
+                size_t values_read = in_file.gcount() / sizeof(uint64_t);
+                if (values_read == 0) {
+                    break;
+                }
+
+                chunk_file.Write(&buffer[0], values_read);
+                chunk_filled += values_read * sizeof(uint64_t);
+                input_pages.Advance(input_size + chunk_filled);
+                form_runs.AddProgress(values_read * sizeof(uint64_t), values_read * sizeof(uint64_t));
+            }
+
+            if (chunk_filled > 0) {
+                temp_file_names.push_back(temp_file_name);
+                sorted_file_names.push_back(temp_file_name + "_s");
+                chunk_file.Close();
+                input_size += chunk_filled;
+                if (manifest != nullptr) {
+                    manifest->AddChunk(temp_file_name, input_size);
+                }
+            } else {
+                ::remove(temp_file_name.c_str());
+            }
+        }
+
+        // block is used again by recursive sorts
+        ValueBuffer().swap(buffer);
+        SortFilesConcurrently(temp_file_names, sorted_file_names, parameters, manifest);
+
+        for (std::string temp_file: temp_file_names) {
+            ::remove(temp_file.c_str());
+        }
+    }
+    return sorted_file_names;
+}
+
+
+std::vector<std::string> FormSortedRuns(std::istream *in_file, ReadBehind *input_pages, std::string temp_file_name_mask, const SortParameters &parameters, ValueBuffer *buffer_pointer, SortManifest *manifest) {
+    ValueBuffer &buffer = *buffer_pointer;
+    std::vector<std::string> sorted_file_names;
+    long long input_size = 0;
+    if (manifest != nullptr) {
+        // runs formed by the previous attempt
+        sorted_file_names = manifest->GetFormedRuns();
+        input_size = manifest->GetFormedInputSize();
+        in_file->seekg(input_size);
+        if (parameters.observer != nullptr) {
+            parameters.observer->AddProgress(input_size, GetRunsSize(sorted_file_names));
+            for (size_t run = 0; run < sorted_file_names.size(); ++run) {
+                parameters.observer->AddRun();
+            }
+        }
+    }
+    // values greater than threshold can't get into first parameters.limit values
+    bool has_threshold = false;
+    uint64_t threshold = 0;
+    long long run_size = parameters.block_size;
+
+    while (*in_file) {
+        if (MemoryGovernor::Get() != nullptr) {
+            long long usable_size = MemoryGovernor::Get()->GetUsableSize(parameters.block_size);
+            if (usable_size < run_size) {
+                ReleaseValues(&buffer, usable_size / sizeof(uint64_t));
+            }
+            run_size = usable_size;
+        }
+        in_file->read((char *) &buffer[0], run_size);
+        size_t bytes_read = in_file->gcount();
+        if (bytes_read < sizeof(uint64_t)) {
+            break;
+        }
+        input_size += bytes_read;
+        if (input_pages != nullptr) {
+            input_pages->Advance(input_size);
+        }
+        if (parameters.observer != nullptr) {
+            parameters.observer->AddProgress(bytes_read, 0);
+        }
+        auto values_end = buffer.begin() + (bytes_read / sizeof(uint64_t));
+        if (has_threshold) {
+            values_end = std::remove_if(buffer.begin(), values_end, [threshold] (uint64_t value) {
+                return value > threshold;
+            });
+        }
+        std::sort(buffer.begin(), values_end);
+
+        long long values_count = values_end - buffer.begin();
+        if (parameters.limit != NO_LIMIT && values_count >= parameters.limit) {
+            values_count = parameters.limit;
+            if (parameters.limit > 0 && (!has_threshold || buffer[parameters.limit - 1] < threshold)) {
+                threshold = buffer[parameters.limit - 1];
+                has_threshold = true;
+            }
+        }
+        if (values_count == 0) {
+            continue;
+        }
+
+        std::string temp_file_name = temp_file_name_mask + std::to_string(sorted_file_names.size());
+        sorted_file_names.push_back(temp_file_name);
+
+        // runs which are not recorded in manifest are never needed after a crash, so they have no name
+        RunWriter out_file(temp_file_name, true, manifest == nullptr ? ANONYMOUS_FILE : NEW_FILE);
+        out_file.Preallocate(values_count * sizeof(uint64_t) + sizeof(RunFooter));
+        out_file.ReportProgress(parameters.observer, false);
+        out_file.Write(&buffer[0], values_count);
+        out_file.Close();
+        if (manifest != nullptr) {
+            manifest->AddFormedRun(temp_file_name, input_size, out_file.GetFooter());
+        }
+        if (parameters.observer != nullptr) {
+            parameters.observer->AddRun();
+        }
+    }
+    return sorted_file_names;
+}
+
+
+std::vector<std::string> FormSortedRunsOnNodes(std::istream *in_file, ReadBehind *input_pages, std::string temp_file_name_mask, const SortParameters &parameters) {
+    NumaTopology topology;
+    int nodes_count = topology.GetNodesCount();
+    long long node_block_size = std::max<long long>(sizeof(uint64_t), parameters.block_size / nodes_count / sizeof(uint64_t) * sizeof(uint64_t));
+
+    // input is read and runs are named under the mutex, blocks are sorted and written concurrently
+    std::mutex input_mutex;
+    long long input_size = 0;
+    std::vector<std::string> sorted_file_names;
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    MemoryArena *arena = MemoryArena::Get();
+    auto form_runs = [&] (int node) {
+        MemoryArenaScope arena_scope(arena);
+        try {
+            topology.BindThread(node);
+            // input is read into buffer by the pinned thread, so its pages are allocated on its node,
+            // unless they come from memory arena, which is touched when it is created
+            ValueBuffer buffer(node_block_size / sizeof(uint64_t));
+            while (!failed) {
+                long long values_count;
+                std::string temp_file_name;
+                {
+                    std::lock_guard<std::mutex> lock(input_mutex);
+                    if (!*in_file) {
+                        break;
+                    }
+                    in_file->read((char *) &buffer[0], node_block_size);
+                    values_count = in_file->gcount() / sizeof(uint64_t);
+                    if (values_count == 0) {
+                        break;
+                    }
+                    input_size += in_file->gcount();
+                    if (input_pages != nullptr) {
+                        input_pages->Advance(input_size);
+                    }
+                    if (parameters.observer != nullptr) {
+                        parameters.observer->AddProgress(in_file->gcount(), 0);
+                    }
+                    temp_file_name = temp_file_name_mask + std::to_string(sorted_file_names.size());
+                    sorted_file_names.push_back(temp_file_name);
+                }
+
+                std::sort(buffer.begin(), buffer.begin() + values_count);
+                if (parameters.limit != NO_LIMIT) {
+                    values_count = std::min(values_count, parameters.limit);
+                }
+                RunWriter out_file(temp_file_name, true, ANONYMOUS_FILE);
+                out_file.Preallocate(values_count * sizeof(uint64_t) + sizeof(RunFooter));
+                out_file.ReportProgress(parameters.observer, false);
+                out_file.Write(&buffer[0], values_count);
+                out_file.Close();
+                if (parameters.observer != nullptr) {
+                    parameters.observer->AddRun();
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!failed) {
+                error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int node = 0; node < nodes_count; ++node) {
+        threads.emplace_back(form_runs, node);
+    }
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+    if (failed) {
+        std::rethrow_exception(error);
+    }
+    return sorted_file_names;
+}
+
+
+std::vector<std::string> ReduceRuns(std::vector<std::string> run_file_names, std::string temp_file_name_mask, const SortParameters &parameters) {
+    SortParameters merge_parameters = parameters;
+    merge_parameters.output_footer = true;
+    merge_parameters.index_interval = NO_INDEX;
+    merge_parameters.anonymous_output = true;
+    int file_name_number = 0;
+
+    while ((int) run_file_names.size() > parameters.branching_degree) {
+        long long groups_count = (run_file_names.size() + parameters.branching_degree - 1) / parameters.branching_degree;
+        ObservedPhase pass(parameters.observer, SortPhase::MERGE_PASS, GetRunsSize(run_file_names), groups_count);
+        std::vector<std::string> merged_file_names;
+        for (size_t group_begin = 0; group_begin < run_file_names.size(); group_begin += parameters.branching_degree) {
+            size_t group_end = std::min(run_file_names.size(), group_begin + parameters.branching_degree);
+            std::vector<std::string> group(run_file_names.begin() + group_begin, run_file_names.begin() + group_end);
+
+            std::string merged_file_name = temp_file_name_mask + std::to_string(file_name_number++);
+            MergeFiles(group, merged_file_name, merge_parameters);
+            pass.AddRun();
+            merged_file_names.push_back(merged_file_name);
+            for (std::string file_name: group) {
+                AnonymousFiles::Remove(file_name);
+            }
+        }
+        run_file_names = merged_file_names;
+    }
+    return run_file_names;
+}
+
+
+long long GetRunsSize(const std::vector<std::string> &run_file_names) {
+    long long size = 0;
+    for (std::string file_name: run_file_names) {
+        FileExtent extent;
+        size += (AnonymousFiles::Find(file_name, &extent) ? extent.size : std::max(0LL, GetFileSize(file_name)));
+    }
+    return size;
+}
+
+
+long long GetBuffersSize(int jobs) {
+    return (jobs + 2) * WRITE_BUFFER_SIZE;
+}
+
+
+std::string GetTempFileNameMask(std::string input_file, std::string output_file) {
+    if (input_file != STANDARD_STREAM_NAME) {
+        return input_file + "_tmp";
+    } else if (output_file != STANDARD_STREAM_NAME) {
+        return output_file + "_tmp";
+    }
+    return "ext_sort" + std::to_string(getpid()) + "_tmp";
+}
+
+
+std::string GetSortDescription(std::string input_file, const SortParameters &parameters) {
+    struct stat stat_buf;
+    if (stat(input_file.c_str(), &stat_buf) != 0) {
+        throw std::runtime_error("Can't open input file " + input_file);
+    }
+    return "ext_sort " + input_file +
+           " size " + std::to_string(stat_buf.st_size) +
+           " modified " + std::to_string(stat_buf.st_mtime) +
+           " block_size " + std::to_string(parameters.block_size) +
+           " branching " + std::to_string(parameters.branching_degree) +
+           " limit " + std::to_string(parameters.limit);
+}
+
+
+std::unique_ptr<std::istream> OpenInputFile(std::string file_name) {
+    std::unique_ptr<std::istream> in_file;
+    if (file_name == STANDARD_STREAM_NAME) {
+        in_file.reset(new std::istream(std::cin.rdbuf()));
+    } else {
+        in_file.reset(new std::ifstream(file_name, std::ios_base::in | std::ios_base::binary));
+    }
+    if (!*in_file) {
+        throw std::runtime_error("Can't open input file " + file_name);
+    }
+    return in_file;
+}
+
+
+// Counting semaphore, bounds resources shared by concurrent sorts
+class Semaphore {
+public:
+    explicit Semaphore(long long count) :
+        count_(count)
+    {}
+
+    void Acquire(long long count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        released_.wait(lock, [this, count] () { return count_ >= count; });
+        count_ -= count;
+    }
+
+    void Release(long long count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        count_ += count;
+        released_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable released_;
+    long long count_;
+};
+
+
+void SortFilesConcurrently(const std::vector<std::string> &all_input_file_names, const std::vector<std::string> &all_output_file_names, const SortParameters &parameters, SortManifest *manifest) {
+    std::vector<std::string> input_file_names;
+    std::vector<std::string> output_file_names;
+    SortObserver *observer = parameters.observer;
+    for (size_t file_idx = 0; file_idx < all_input_file_names.size(); ++file_idx) {
+        if (manifest == nullptr || !manifest->IsSorted(all_output_file_names[file_idx])) {
+            input_file_names.push_back(all_input_file_names[file_idx]);
+            output_file_names.push_back(all_output_file_names[file_idx]);
+        } else if (observer != nullptr) {
+            observer->AddProgress(GetFileSize(all_input_file_names[file_idx]), GetFileSize(all_input_file_names[file_idx]));
+            observer->AddRun();
+        }
+    }
+    // records output file in manifest once it is sorted, and reports the file as a run of the outer sort
+    auto sort_file = [manifest, observer] (std::string input_file_name, std::string output_file_name, const SortParameters &job_parameters) {
+        ExternalMergeSort(input_file_name, output_file_name, job_parameters);
+        if (manifest != nullptr) {
+            manifest->AddSortedRun(input_file_name, output_file_name, RunReader(output_file_name, 1, false).GetFooter());
+        }
+        if (observer != nullptr) {
+            observer->AddProgress(GetFileSize(input_file_name), GetFileSize(input_file_name));
+            observer->AddRun();
+        }
+    };
+
+    size_t files_count = input_file_names.size();
+    int jobs = std::max(1, std::min<int>(parameters.jobs, files_count));
+
+    // every job gets an equal part of the block, recursive sorts don't start jobs of their own
+    SortParameters job_parameters = parameters;
+    job_parameters.jobs = 1;
+    job_parameters.output_footer = true;
+    job_parameters.output_partitions = 1;
+    job_parameters.index_interval = NO_INDEX;
+    job_parameters.checkpoint = false;
+    job_parameters.observer = nullptr;
+    // sorted files are read back by name only when they are recorded in the manifest
+    job_parameters.anonymous_output = (manifest == nullptr);
+    // jobs are spread over NUMA nodes, a single job spreads its own run formation over them
+    job_parameters.numa = (parameters.numa && jobs == 1);
+    job_parameters.block_size = std::max<long long>(sizeof(uint64_t), parameters.block_size / jobs / sizeof(uint64_t) * sizeof(uint64_t));
+
+    if (jobs == 1) {
+        for (size_t file_idx = 0; file_idx < files_count; ++file_idx) {
+            sort_file(input_file_names[file_idx], output_file_names[file_idx], job_parameters);
+        }
+        return;
+    }
+
+    int device_jobs = (parameters.device_jobs == NO_DEVICE_JOBS_LIMIT ? jobs : parameters.device_jobs);
+    // slots of the device of every file are found before jobs start, so that they only read file_slots
+    std::map<dev_t, std::unique_ptr<Semaphore>> device_slots;
+    std::vector<Semaphore *> file_slots;
+    for (std::string file_name: input_file_names) {
+        struct stat stat_buf;
+        dev_t device = (stat(file_name.c_str(), &stat_buf) == 0 ? stat_buf.st_dev : 0);
+        if (device_slots.count(device) == 0) {
+            device_slots[device].reset(new Semaphore(device_jobs));
+        }
+        file_slots.push_back(device_slots[device].get());
+    }
+
+    std::atomic<size_t> next_file_idx(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    NumaTopology topology;
+
+    // block of a recursive sort is allocated by the thread which runs it, on its node
+    MemoryArena *arena = MemoryArena::Get();
+    auto sort_files = [&] (int job) {
+        MemoryArenaScope arena_scope(arena);
+        if (parameters.numa) {
+            topology.BindThread(job);
+        }
+        for (size_t file_idx = next_file_idx++; file_idx < files_count && !failed; file_idx = next_file_idx++) {
+            Semaphore &device_slot = *file_slots[file_idx];
+            device_slot.Acquire(1);
+            try {
+                sort_file(input_file_names[file_idx], output_file_names[file_idx], job_parameters);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!failed) {
+                    error = std::current_exception();
+                    failed = true;
+                }
+            }
+            device_slot.Release(1);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int job = 0; job < jobs; ++job) {
+        threads.emplace_back(sort_files, job);
+    }
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+    if (failed) {
+        std::rethrow_exception(error);
+    }
+}
+
+
+
+
+// Replaces the greatest value of max-heap with value, and sifts it down to its place
+void ReplaceGreatestValue(ValueBuffer *heap, uint64_t value) {
+    size_t size = heap->size();
+    size_t index = 0;
+    while (2 * index + 1 < size) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < size && (*heap)[child] < (*heap)[child + 1]) {
+            ++child;
+        }
+        if (!(value < (*heap)[child])) {
+            break;
+        }
+        (*heap)[index] = (*heap)[child];
+        index = child;
+    }
+    (*heap)[index] = value;
+}
+
+
+void SelectSmallestValues(std::string input_file_name, std::string output_file_name, const SortParameters &parameters) {
+    // max-heap, front is the greatest of the smallest values found so far
+    // it is a value buffer, so it is allocated from the memory arena, and sorted in place when input ends
+    ValueBuffer smallest_values;
+    long long file_size = GetFileSize(input_file_name);
+    long long limit = parameters.limit;
+    smallest_values.reserve(file_size < 0 ? limit : std::min<long long>(limit, file_size / sizeof(uint64_t)));
+
+    {
+        std::unique_ptr<std::istream> in_file = OpenInputFile(input_file_name);
+        ValueBuffer buffer(std::min(parameters.block_size, READ_BUFFER_SIZE) / sizeof(uint64_t));
+
+        while (*in_file && limit > 0) {
+            in_file->read((char *) &buffer[0], buffer.size() * sizeof(uint64_t));
+            size_t values_read = in_file->gcount() / sizeof(uint64_t);
+
+            for (size_t value_idx = 0; value_idx < values_read; ++value_idx) {
+                uint64_t value = buffer[value_idx];
+                if ((long long) smallest_values.size() < limit) {
+                    smallest_values.push_back(value);
+                    std::push_heap(smallest_values.begin(), smallest_values.end());
+                } else if (value < smallest_values.front()) {
+                    ReplaceGreatestValue(&smallest_values, value);
+                }
+            }
+        }
+    }
+    std::sort_heap(smallest_values.begin(), smallest_values.end());
+
+    RunWriter out_file(output_file_name, parameters.output_footer, parameters.anonymous_output ? ANONYMOUS_FILE : NEW_FILE);
+    out_file.Preallocate(smallest_values.size() * sizeof(uint64_t) + (parameters.output_footer ? sizeof(RunFooter) : 0));
+    AddSparseIndex(&out_file, output_file_name, parameters);
+    out_file.ReportProgress(parameters.observer, false);
+    out_file.Write(smallest_values.data(), smallest_values.size());
+    out_file.Close();
+}
+
+
+void ExternalMergeSort(std::string input_file, std::string output_file, const SortParameters &parameters) {
+    if (parameters.limit != NO_LIMIT && parameters.limit * (long long) sizeof(uint64_t) <= parameters.block_size) {
+        // one scan of input, reported as its only phase
+        ObservedPhase select(parameters.observer, SortPhase::FINAL_MERGE, GetFileSize(input_file), 1);
+        SelectSmallestValues(input_file, output_file, parameters);
+        select.AddProgress(std::max(0LL, GetFileSize(input_file)), 0);
+        select.AddRun();
+        return;
+    }
+
+    std::string temp_file_name_mask = GetTempFileNameMask(input_file, output_file);
+    std::vector<std::string> temp_file_names;
+    std::unique_ptr<SortManifest> manifest;
+    if (input_file == STANDARD_STREAM_NAME) {
+        // size of input is unknown, so runs are formed as it is read, and merged in several passes if needed
+        std::unique_ptr<std::istream> in_file = OpenInputFile(input_file);
+        {
+            ObservedPhase form_runs(parameters.observer, SortPhase::FORM_RUNS, -1, -1);
+            if (parameters.numa) {
+                temp_file_names = FormSortedRunsOnNodes(in_file.get(), nullptr, temp_file_name_mask, parameters);
+            } else {
+                ValueBuffer buffer(parameters.block_size / sizeof(uint64_t));
+                temp_file_names = FormSortedRuns(in_file.get(), nullptr, temp_file_name_mask, parameters, &buffer, nullptr);
+            }
+        }
+        temp_file_names = ReduceRuns(temp_file_names, temp_file_name_mask + "_m", parameters);
+    } else {
+        if (parameters.checkpoint) {
+            manifest.reset(new SortManifest(temp_file_name_mask + "_manifest", GetSortDescription(input_file, parameters)));
+        }
+        temp_file_names = SplitFileIntoSortedFiles(input_file, temp_file_name_mask, parameters, manifest.get());
+    }
+    {
+        long long runs_size = GetRunsSize(temp_file_names);
+        ObservedPhase merge(parameters.observer, SortPhase::FINAL_MERGE, runs_size, parameters.output_partitions);
+        if (parameters.output_partitions > 1) {
+            MergeFilesIntoPartitions(temp_file_names, output_file, parameters);
+        } else {
+            MergeFiles(temp_file_names, output_file, parameters);
+            merge.AddRun();
+        }
+    }
+
+    // remove unnecessary files
+    for (std::string temp_file: temp_file_names) {
+        AnonymousFiles::Remove(temp_file);
+    }
+    if (manifest) {
+        manifest->Remove();
+    }
+}
+
+
+std::vector<uint64_t> SampleSplitters(std::string input_file_name, long long file_size, int splitters_count) {
+    long long values_count = file_size / sizeof(uint64_t);
+    std::vector<uint64_t> sample;
+    if (splitters_count == 0 || values_count == 0) {
+        return sample;
+    }
+
+    // read sample in the order of offsets, so that disk head moves in one direction
+    std::mt19937_64 generator(values_count);
+    std::uniform_int_distribution<long long> position(0, values_count - 1);
+    std::vector<long long> positions((splitters_count + 1) * SAMPLES_PER_BUCKET);
+    for (long long &value_position: positions) {
+        value_position = position(generator);
+    }
+    std::sort(positions.begin(), positions.end());
+
+    std::ifstream in_file(input_file_name, std::ios_base::in | std::ios_base::binary);
+    for (long long value_position: positions) {
+        uint64_t value;
+        in_file.seekg(value_position * sizeof(uint64_t));
+        in_file.read((char *) &value, sizeof(value));
+        sample.push_back(value);
+    }
+    std::sort(sample.begin(), sample.end());
+
+    std::vector<uint64_t> splitters;
+    for (int splitter_idx = 1; splitter_idx <= splitters_count; ++splitter_idx) {
+        splitters.push_back(sample[splitter_idx * SAMPLES_PER_BUCKET]);
+    }
+    return splitters;
+}
+
+
+// Writes every value of input file into the bucket file with index returned by get_bucket for the value
+// Buffer is split between buckets to collect values before writing them
+// Returns sizes of bucket files in bytes
+template <typename TGetBucket>
+std::vector<long long> ScatterIntoBuckets(std::string input_file_name, const std::vector<std::string> &bucket_file_names, ValueBuffer *buffer, TGetBucket get_bucket) {
+    size_t buckets_count = bucket_file_names.size();
+    size_t bucket_capacity = buffer->size() / buckets_count;
+    if (bucket_capacity == 0) {
+        throw std::runtime_error("Block is too small to hold a value for every bucket");
+    }
+
+    std::vector<std::ofstream> bucket_files;
+    for (std::string file_name: bucket_file_names) {
+        bucket_files.emplace_back(file_name, std::ios_base::out | std::ios_base::binary);
+    }
+    // bucket with index i collects values in (*buffer)[i * bucket_capacity, i * bucket_capacity + bucket_filled[i])
+    std::vector<size_t> bucket_filled(buckets_count, 0);
+    std::vector<long long> bucket_sizes(buckets_count, 0);
+
+    std::ifstream in_file(input_file_name, std::ios_base::in | std::ios_base::binary);
+    ReadBehind input_pages(input_file_name);
+    std::vector<uint64_t> read_buffer(READ_BUFFER_SIZE / sizeof(uint64_t));
+    long long input_size = 0;
+
+    while (in_file) {
+        in_file.read((char *) &read_buffer[0], READ_BUFFER_SIZE);
+        size_t values_read = in_file.gcount() / sizeof(uint64_t);
+        input_size += in_file.gcount();
+        input_pages.Advance(input_size);
+
+        for (size_t value_idx = 0; value_idx < values_read; ++value_idx) {
+            uint64_t value = read_buffer[value_idx];
+            size_t bucket = get_bucket(value);
+            uint64_t *bucket_begin = &(*buffer)[bucket * bucket_capacity];
+
+            bucket_begin[bucket_filled[bucket]++] = value;
+            if (bucket_filled[bucket] == bucket_capacity) {
+                bucket_files[bucket].write((char *) bucket_begin, bucket_capacity * sizeof(uint64_t));
+                bucket_sizes[bucket] += bucket_capacity * sizeof(uint64_t);
+                bucket_filled[bucket] = 0;
+            }
+        }
+    }
+
+    for (size_t bucket = 0; bucket < buckets_count; ++bucket) {
+        bucket_files[bucket].write((char *) &(*buffer)[bucket * bucket_capacity], bucket_filled[bucket] * sizeof(uint64_t));
+        bucket_sizes[bucket] += bucket_filled[bucket] * sizeof(uint64_t);
+        bucket_files[bucket].flush();
+    }
+    return bucket_sizes;
+}
+
+
+std::vector<long long> DistributeIntoBuckets(std::string input_file_name, const std::vector<uint64_t> &splitters, const std::vector<std::string> &bucket_file_names, ValueBuffer *buffer) {
+    return ScatterIntoBuckets(input_file_name, bucket_file_names, buffer, [&splitters] (uint64_t value) {
+        return std::upper_bound(splitters.begin(), splitters.end(), value) - splitters.begin();
+    });
+}
+
+
+long long GetBucketsCount(long long file_size, long long block_size) {
+    long long buckets_count = ceil(double(file_size) * BUCKET_FILL_FACTOR / block_size);
+    // every bucket needs a write buffer of reasonable size,
+    // buckets that don't fit into memory because of that are sorted recursively
+    buckets_count = std::min(buckets_count, block_size / MIN_BUCKET_BUFFER_SIZE);
+    return std::max(buckets_count, 1LL);
+}
+
+
+void ExternalDistributionSort(std::string input_file, std::string output_file, const SortParameters &parameters) {
+    long long file_size = GetFileSize(input_file);
+    if (file_size < 0) {
+        throw std::runtime_error("Can't open input file " + input_file);
+    }
+    ValueBuffer buffer(parameters.block_size / sizeof(uint64_t));
+
+    long long buckets_count = GetBucketsCount(file_size, parameters.block_size);
+
+    std::vector<std::string> bucket_file_names;
+    std::vector<long long> bucket_sizes;
+    if (buckets_count == 1) {
+        bucket_file_names.push_back(input_file);
+        bucket_sizes.push_back(file_size);
+    } else {
+        std::vector<uint64_t> splitters = SampleSplitters(input_file, file_size, buckets_count - 1);
+        for (long long bucket = 0; bucket < buckets_count; ++bucket) {
+            bucket_file_names.push_back(input_file + "_bucket" + std::to_string(bucket));
+        }
+        bucket_sizes = DistributeIntoBuckets(input_file, splitters, bucket_file_names, &buffer);
+    }
+
+    RunWriter out_file(output_file, false);
+    out_file.Preallocate(parameters.limit == NO_LIMIT ? file_size : std::min<long long>(file_size, parameters.limit * sizeof(uint64_t)));
+    AddSparseIndex(&out_file, output_file, parameters);
+    long long values_written = 0;
+
+    for (size_t bucket = 0; bucket < bucket_file_names.size(); ++bucket) {
+        long long values_count = bucket_sizes[bucket] / sizeof(uint64_t);
+        if (parameters.limit != NO_LIMIT) {
+            values_count = std::min(values_count, parameters.limit - values_written);
+        }
+
+        if (values_count > 0 && bucket_sizes[bucket] <= parameters.block_size) {
+            std::ifstream bucket_file(bucket_file_names[bucket], std::ios_base::in | std::ios_base::binary);
+            bucket_file.read((char *) &buffer[0], bucket_sizes[bucket]);
+            auto values_end = buffer.begin() + bucket_sizes[bucket] / sizeof(uint64_t);
+
+            std::partial_sort(buffer.begin(), buffer.begin() + values_count, values_end);
+            out_file.Write(&buffer[0], values_count);
+        } else if (values_count > 0) {
+            // bucket overflowed, sort it separately
+            // if distribution made no progress (e.g. all values are equal), fall back to merge sort
+            std::string sorted_bucket_file_name = bucket_file_names[bucket] + "_s";
+            SortParameters bucket_parameters = parameters;
+            bucket_parameters.limit = (parameters.limit == NO_LIMIT ? NO_LIMIT : values_count);
+            bucket_parameters.output_footer = false;
+            bucket_parameters.index_interval = NO_INDEX;
+            if (bucket_sizes[bucket] < file_size) {
+                ExternalDistributionSort(bucket_file_names[bucket], sorted_bucket_file_name, bucket_parameters);
+            } else {
+                ExternalMergeSort(bucket_file_names[bucket], sorted_bucket_file_name, bucket_parameters);
+            }
+
+            std::ifstream sorted_bucket_file(sorted_bucket_file_name, std::ios_base::in | std::ios_base::binary);
+            while (sorted_bucket_file) {
+                sorted_bucket_file.read((char *) &buffer[0], parameters.block_size);
+                out_file.Write(&buffer[0], sorted_bucket_file.gcount() / sizeof(uint64_t));
+            }
+            ::remove(sorted_bucket_file_name.c_str());
+        }
+        values_written += values_count;
+
+        if (buckets_count > 1) {
+            ::remove(bucket_file_names[bucket].c_str());
+        }
+    }
+
+    out_file.Close();
+}
+
+
+void ExternalShuffle(std::string input_file, std::string output_file, const SortParameters &parameters, uint64_t seed) {
+    long long file_size = GetFileSize(input_file);
+    if (file_size < 0) {
+        throw std::runtime_error("Can't open input file " + input_file);
+    }
+    ValueBuffer buffer(parameters.block_size / sizeof(uint64_t));
+    std::mt19937_64 generator(seed);
+
+    long long buckets_count = GetBucketsCount(file_size, parameters.block_size);
+    if (file_size > parameters.block_size) {
+        // random buckets are smaller than input even when block fits only a few bucket buffers,
+        // but every bucket needs room for at least one value
+        if (buffer.size() < 2) {
+            throw std::runtime_error("Block is too small to shuffle input, it must hold at least 2 values");
+        }
+        buckets_count = std::min<long long>(std::max(buckets_count, 2LL), buffer.size());
+    }
+    std::vector<std::string> bucket_file_names;
+    std::vector<long long> bucket_sizes;
+    if (buckets_count == 1) {
+        bucket_file_names.push_back(input_file);
+        bucket_sizes.push_back(file_size);
+    } else {
+        for (long long bucket = 0; bucket < buckets_count; ++bucket) {
+            bucket_file_names.push_back(input_file + "_bucket" + std::to_string(bucket));
+        }
+        std::uniform_int_distribution<size_t> random_bucket(0, buckets_count - 1);
+        bucket_sizes = ScatterIntoBuckets(input_file, bucket_file_names, &buffer, [&generator, &random_bucket] (uint64_t) {
+            return random_bucket(generator);
+        });
+    }
+
+    RunWriter out_file(output_file, false);
+    out_file.Preallocate(parameters.limit == NO_LIMIT ? file_size : std::min<long long>(file_size, parameters.limit * sizeof(uint64_t)));
+    long long values_written = 0;
+
+    for (size_t bucket = 0; bucket < bucket_file_names.size(); ++bucket) {
+        long long values_count = bucket_sizes[bucket] / sizeof(uint64_t);
+        if (parameters.limit != NO_LIMIT) {
+            values_count = std::min(values_count, parameters.limit - values_written);
+        }
+
+        if (values_count > 0 && bucket_sizes[bucket] <= parameters.block_size) {
+            std::ifstream bucket_file(bucket_file_names[bucket], std::ios_base::in | std::ios_base::binary);
+            bucket_file.read((char *) &buffer[0], bucket_sizes[bucket]);
+            std::shuffle(buffer.begin(), buffer.begin() + bucket_sizes[bucket] / sizeof(uint64_t), generator);
+            out_file.Write(&buffer[0], values_count);
+        } else if (values_count > 0) {
+            // bucket overflowed, shuffle it separately
+            std::string shuffled_bucket_file_name = bucket_file_names[bucket] + "_s";
+            SortParameters bucket_parameters = parameters;
+            bucket_parameters.limit = (parameters.limit == NO_LIMIT ? NO_LIMIT : values_count);
+            ExternalShuffle(bucket_file_names[bucket], shuffled_bucket_file_name, bucket_parameters, generator());
+
+            std::ifstream shuffled_bucket_file(shuffled_bucket_file_name, std::ios_base::in | std::ios_base::binary);
+            while (shuffled_bucket_file) {
+                shuffled_bucket_file.read((char *) &buffer[0], parameters.block_size);
+                out_file.Write(&buffer[0], shuffled_bucket_file.gcount() / sizeof(uint64_t));
+            }
+            ::remove(shuffled_bucket_file_name.c_str());
+        }
+        values_written += values_count;
+
+        if (buckets_count > 1) {
+            ::remove(bucket_file_names[bucket].c_str());
+        }
+    }
+
+    out_file.Close();
+}
+
+
+void *MapFile(int file_descriptor, long long size, bool writable) {
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(nullptr, size, protection, writable ? MAP_SHARED : MAP_PRIVATE, file_descriptor, 0);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Can't map file into memory");
+    }
+    return data;
+}
+
+
+// Closes file descriptor when it goes out of scope, so that it is not leaked when a later step throws
+class ScopedFileDescriptor {
+public:
+    explicit ScopedFileDescriptor(int file_descriptor) :
+        file_descriptor_(file_descriptor)
+    {}
+
+    ~ScopedFileDescriptor() {
+        if (file_descriptor_ >= 0) {
+            close(file_descriptor_);
+        }
+    }
+
+    ScopedFileDescriptor(const ScopedFileDescriptor &) = delete;
+    ScopedFileDescriptor &operator = (const ScopedFileDescriptor &) = delete;
+
+    int Get() const {
+        return file_descriptor_;
+    }
+
+private:
+    int file_descriptor_;
+};
+
+
+// Maps file with MapFile and unmaps it when it goes out of scope
+class ScopedMapping {
+public:
+    ScopedMapping(int file_descriptor, long long size, bool writable) :
+        data_(MapFile(file_descriptor, size, writable)),
+        size_(size)
+    {}
+
+    ~ScopedMapping() {
+        munmap(data_, size_);
+    }
+
+    ScopedMapping(const ScopedMapping &) = delete;
+    ScopedMapping &operator = (const ScopedMapping &) = delete;
+
+    uint64_t *Get() const {
+        return (uint64_t *) data_;
+    }
+
+private:
+    void *data_;
+    long long size_;
+};
+
+
+void FunnelSortFile(std::string input_file, std::string output_file, long long limit) {
+    long long file_size = GetFileSize(input_file);
+    if (file_size < 0) {
+        throw std::runtime_error("Can't open input file " + input_file);
+    }
+    long long values_count = file_size / sizeof(uint64_t);
+    long long data_size = values_count * sizeof(uint64_t);
+    std::string scratch_file = output_file + "_tmp";
+
+    ScopedFileDescriptor in_fd(open(input_file.c_str(), O_RDONLY));
+    ScopedFileDescriptor out_fd(open(output_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+    ScopedFileDescriptor scratch_fd(open(scratch_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+    // scratch space is not needed after the process exits
+    ::remove(scratch_file.c_str());
+    if (in_fd.Get() < 0 || out_fd.Get() < 0 || scratch_fd.Get() < 0 ||
+        ftruncate(out_fd.Get(), data_size) != 0 ||
+        ftruncate(scratch_fd.Get(), data_size) != 0) {
+        throw std::runtime_error("Can't create files for funnel sort");
+    }
+
+    if (values_count > 0) {
+        ScopedMapping output(out_fd.Get(), data_size, true);
+        ScopedMapping scratch(scratch_fd.Get(), data_size, true);
+        {
+            ScopedMapping input(in_fd.Get(), data_size, false);
+            std::copy(input.Get(), input.Get() + values_count, output.Get());
+        }
+        algorithms::FunnelSort<uint64_t>(output.Get(), output.Get() + values_count, scratch.Get());
+    }
+
+    if (limit != NO_LIMIT && limit < values_count) {
+        if (ftruncate(out_fd.Get(), limit * sizeof(uint64_t)) != 0) {
+            throw std::runtime_error("Can't truncate output file");
+        }
+    }
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <istream>
+#include <cstdint>
+#include "run_file.hpp"
+
+class SortManifest;
+class SortObserver;
+
+const long long NO_LIMIT = -1;
+const long long READ_BUFFER_SIZE = 1024 * 1024; // 1 MB
+const long long MIN_MERGE_BUFFER_SIZE = 4 * 1024; // 4 KB
+const int NO_DEVICE_JOBS_LIMIT = 0;
+// Buckets are planned to be half of block size, so that sampling error doesn't overflow them
+const int BUCKET_FILL_FACTOR = 2;
+const int SAMPLES_PER_BUCKET = 32;
+const long long MIN_BUCKET_BUFFER_SIZE = 64 * 1024; // 64 KB
+
+// Parameters of a sort, passed down to recursive sorts
+struct SortParameters {
+    long long block_size;
+    int branching_degree;
+    long long limit;
+    // maximum number of recursive sorts running at the same time
+    int jobs;
+    // maximum number of recursive sorts of files on one device running at the same time,
+    // or NO_DEVICE_JOBS_LIMIT
+    int device_jobs;
+    // check checksums of sorted runs while merging them
+    bool verify;
+    // write RunFooter after sorted values, set when output is a run of an outer sort
+    bool output_footer;
+    // number of files the output is split into, see MergeFilesIntoPartitions
+    int output_partitions;
+    // write sparse index with every index_interval-th value next to the output, unless NO_INDEX
+    long long index_interval;
+    // record completed runs in a manifest next to temporary files, and reuse runs of a previous attempt
+    // of the same sort, see sort_manifest.hpp
+    bool checkpoint;
+    // form runs and merge ranges in threads pinned to NUMA nodes, every one with its part of the block
+    // allocated on its node, see FormSortedRunsOnNodes
+    bool numa;
+    // receives phases and progress of the sort, or nullptr, see sort_observer.hpp
+    SortObserver *observer;
+    // write the output as an anonymous run (see AnonymousFiles), set for runs of an outer sort
+    // which are not recorded in a manifest
+    bool anonymous_output;
+};
+
+// Sorts file with name input_file and writes result into file with name output_file
+// Assumes input file and output file are binary
+// Block size is maximum file size which can be loaded into RAM
+// Branching is maximum number of splits per file
+// If limit is not NO_LIMIT, only the limit smallest values are written
+void ExternalMergeSort(std::string input_file, std::string output_file, const SortParameters &parameters);
+// Splits a file into a sequence of sorted runs (see run_file.hpp)
+// Sorting of blocks is performed sequentially (not parallel),
+// because it's assumed that only block of size block_size fits into memory
+// If limit is not NO_LIMIT, every sorted file is truncated to limit values,
+// and values greater than the limit-th smallest value seen so far are dropped
+// Records completed chunks and sorted files in manifest, unless it is nullptr
+// Returns vector with filenames, that store sorted files
+std::vector<std::string> SplitFileIntoSortedFiles(std::string input_file_name, std::string temp_file_name_mask, const SortParameters &parameters, SortManifest *manifest);
+// Reads input block by block until it ends and writes every sorted block as a run
+// Needs no input size, so input may be a pipe
+// If limit is not NO_LIMIT, runs are truncated like in SplitFileIntoSortedFiles
+// If manifest is not nullptr, runs recorded in it are reused, reading continues after their part of input,
+// and every new run is recorded
+// If MemoryGovernor is created, every run is formed from the part of the block it allows, the rest is released
+// Consumed input is dropped from page cache through input_pages, unless it is nullptr
+// Returns vector with filenames, that store sorted files
+std::vector<std::string> FormSortedRuns(std::istream *in_file, ReadBehind *input_pages, std::string temp_file_name_mask, const SortParameters &parameters, ValueBuffer *buffer, SortManifest *manifest);
+// Forms sorted runs like FormSortedRuns, but with a thread pinned to every NUMA node,
+// which reads blocks of input in turn and sorts them in its own part of the block, allocated on its node,
+// so that blocks are sorted on all nodes at the same time, without traffic between nodes
+// Runs are not recorded in a manifest, if limit is not NO_LIMIT, every run is truncated to limit values
+std::vector<std::string> FormSortedRunsOnNodes(std::istream *in_file, ReadBehind *input_pages, std::string temp_file_name_mask, const SortParameters &parameters);
+// Merges runs in groups of branching degree until at most branching degree runs are left
+// Returns vector with filenames of the remaining runs
+std::vector<std::string> ReduceRuns(std::vector<std::string> run_file_names, std::string temp_file_name_mask, const SortParameters &parameters);
+// Returns total size of run files (named or anonymous) in bytes
+long long GetRunsSize(const std::vector<std::string> &run_file_names);
+// Returns memory besides the block used by write buffers of a sort with jobs jobs:
+// every job writing runs or merging ranges at the same time has a write buffer, one more is used for writing chunks of input,
+// and one more is left because free memory of an arena may be split between buffers
+long long GetBuffersSize(int jobs);
+// Returns prefix for names of temporary files, which are created next to input or output file
+std::string GetTempFileNameMask(std::string input_file, std::string output_file);
+// Returns description of the sort of input file, which changes if input or parameters change
+std::string GetSortDescription(std::string input_file, const SortParameters &parameters);
+// Opens binary file for reading, or standard input for STANDARD_STREAM_NAME
+std::unique_ptr<std::istream> OpenInputFile(std::string file_name);
+// Sorts every input file into the output file with the same index
+// Runs up to parameters.jobs sorts at the same time, every one with an equal part of the block,
+// and at most parameters.device_jobs of them sort files on the same device
+// With parameters.numa, sorts are spread over NUMA nodes, every one runs on one node
+// Files recorded as sorted in manifest are skipped, and every sorted file is recorded, unless manifest is nullptr
+void SortFilesConcurrently(const std::vector<std::string> &input_file_names, const std::vector<std::string> &output_file_names, const SortParameters &parameters, SortManifest *manifest);
+// Merges sorted runs into one big file
+// Input is in input_file_names, output is in output_file_name
+// Runs which don't overlap with other runs are copied without comparisons
+// Stops after limit values are written, unless limit is NO_LIMIT
+// Output which is a plain file without limit, footer, index and verification is merged
+// by parameters.jobs threads with MergeFilesConcurrently
+void MergeFiles(const std::vector<std::string> &input_file_names, std::string output_file_name, const SortParameters &parameters, RunFormat input_format = RUN_WITH_FOOTER);
+// Sorts runs by their smallest values and merges groups of overlapping runs one after another
+void MergeRunGroups(std::vector<RunReader *> runs, RunWriter *out_file, long long *values_left);
+// Merges sorted runs into parameters.output_partitions files named by GetPartitionFileName,
+// every one holding a contiguous range of values, partitions are of roughly equal size
+// Every run is split at the splitters with binary search, so partitions are merged independently,
+// up to parameters.jobs of them at the same time (spread over NUMA nodes with parameters.numa)
+void MergeFilesIntoPartitions(const std::vector<std::string> &input_file_names, std::string output_file_name, const SortParameters &parameters);
+// Merges sorted runs into one file, splitting them into parameters.jobs ranges of values
+// which are merged at the same time, every range written at its own offset of the output
+void MergeFilesConcurrently(const std::vector<std::string> &input_file_names, std::string output_file_name, const SortParameters &parameters, RunFormat input_format);
+// Splits every run into ranges_count ranges of values, the same for all runs
+// Returns run_bounds, where run_bounds[run][range] is index of the first value of the range in the run
+// and run_bounds[run][ranges_count] is the number of values in the run
+std::vector<std::vector<uint64_t>> SplitRunsIntoRanges(const std::vector<std::string> &input_file_names, RunFormat input_format, int ranges_count);
+// Merges ranges_count ranges of runs between run_bounds (see SplitRunsIntoRanges), up to parameters.jobs at the same time
+// Range is written into its partition file (see GetPartitionFileName), or, if single_output is set,
+// into output file at offset equal to the size of the ranges before it
+void MergeRangesConcurrently(const std::vector<std::string> &input_file_names, RunFormat input_format, const std::vector<std::vector<uint64_t>> &run_bounds, int ranges_count, std::string output_file_name, bool single_output, const SortParameters &parameters);
+// Returns partitions_count - 1 splitters, chosen from evenly spaced samples of every run,
+// weighted by size of the run
+std::vector<uint64_t> SampleRunSplitters(const std::vector<RunReader *> &runs, int partitions_count);
+// Returns evenly spaced samples of every run, enough to choose partitions_count - 1 splitters,
+// every one with the number of values it stands for
+std::vector<std::pair<uint64_t, double>> SampleRuns(const std::vector<RunReader *> &runs, int partitions_count);
+// Returns partitions_count - 1 splitters which split weighted samples into parts of equal weight
+std::vector<uint64_t> ChooseSplitters(std::vector<std::pair<uint64_t, double>> samples, int partitions_count);
+// Returns name of the output file of partition with index partition
+std::string GetPartitionFileName(std::string output_file_name, int partition);
+// Makes out_file write sparse index of the output file, if parameters ask for it (see sparse_index.hpp)
+void AddSparseIndex(RunWriter *out_file, std::string output_file_name, const SortParameters &parameters);
+// Merges runs, writing at most *values_left values,
+// decreases *values_left by the number of written values
+// Gallops through the run on the top of the heap, so that values which are not greater
+// than the top of any other run are written as one range without going through the heap
+void MergeRuns(const std::vector<RunReader *> &runs, RunWriter *out_file, long long *values_left);
+// Returns number of leading values not greater than bound,
+// using exponential search, so that short ranges are found in few comparisons
+size_t GallopUpperBound(const uint64_t *values, size_t count, uint64_t bound);
+// Returns part of block of block_size bytes to use for buffers of the next merge, see MemoryGovernor
+long long GetMergeMemorySize(long long block_size);
+// Returns size of read buffer in values for each of runs_count runs being merged
+long long GetMergeBufferSize(long long block_size, size_t runs_count);
+// Writes limit smallest values of input file into output file in sorted order
+// Performs one sequential scan, keeping the values in a bounded max-heap,
+// so limit values must fit into block_size
+void SelectSmallestValues(std::string input_file_name, std::string output_file_name, const SortParameters &parameters);
+// Sorts file with name input_file and writes result into file with name output_file
+// Chooses splitters from a sample of the input, distributes input into buckets
+// in one pass, then sorts every bucket in memory and appends it to the output,
+// so that input which fits into the buckets is sorted in two passes without merging
+// Buckets which turn out bigger than block_size are sorted recursively
+void ExternalDistributionSort(std::string input_file, std::string output_file, const SortParameters &parameters);
+// Returns splitters_count sorted values, chosen from a random sample of the file
+std::vector<uint64_t> SampleSplitters(std::string input_file_name, long long file_size, int splitters_count);
+// Writes every value of input file into the bucket file
+// with index equal to the number of splitters not greater than the value
+// Buffer is split between buckets to collect values before writing them
+// Returns sizes of bucket files in bytes
+std::vector<long long> DistributeIntoBuckets(std::string input_file_name, const std::vector<uint64_t> &splitters, const std::vector<std::string> &bucket_file_names, ValueBuffer *buffer);
+// Writes values of input file into output file in uniformly random order, determined by seed
+// Scatters values into buckets chosen at random in one pass, then shuffles every bucket in memory
+// and appends it to the output, so input is read twice
+// Buckets which turn out bigger than block_size are shuffled recursively
+void ExternalShuffle(std::string input_file, std::string output_file, const SortParameters &parameters, uint64_t seed);
+// Returns number of buckets of about half of block size to distribute file into
+long long GetBucketsCount(long long file_size, long long block_size);
+// Sorts file with name input_file and writes result into file with name output_file
+// Uses lazy funnelsort, which is cache-oblivious, so block size and branching are not needed
+// Input, output and scratch space of the size of input are memory mapped,
+// and the kernel moves them between memory and disk
+// With limit the whole input is still sorted, and output is truncated to the first limit values afterwards
+void FunnelSortFile(std::string input_file, std::string output_file, long long limit);
+// Maps size bytes of the file into memory, throws on failure
+void *MapFile(int file_descriptor, long long size, bool writable);
+// Creates file of size bytes with disk space reserved for them, so that its parts can be written at their offsets
+void CreateFileOfSize(std::string file_name, long long size);
+// Utility function that returns file size
+long long GetFileSize(std::string filename);
+
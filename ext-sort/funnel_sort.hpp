@@ -0,0 +1,208 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+namespace algorithms {
+
+// Arrays not longer than this are sorted with std::sort
+const long long FUNNEL_SORT_BASE_SIZE = 256;
+
+// Lazy k-funnel (Brodal, Fagerberg, "Cache Oblivious Distribution Sweeping")
+// Merges k sorted arrays with a complete binary tree of binary mergers.
+// Every edge of the tree has a buffer, and the tree is stored in van Emde Boas order:
+// top tree of half the height first, then every bottom tree preceded by its output buffer.
+// An edge cut when splitting a subtree with k leaves gets a buffer of k^(3/2) elements.
+template <typename TElement, typename TComparator = std::less<TElement>>
+class Funnel {
+    public:
+        // Inputs are sorted arrays [begin, end)
+        Funnel(const std::vector<std::pair<TElement *, TElement *>> &inputs);
+
+        // Merges all inputs into output, which must have room for all input elements
+        void Merge(TElement *output);
+
+    private:
+        struct Node {
+            TElement *buffer_begin;
+            TElement *buffer_end;
+            // elements of the buffer which are not consumed by the parent yet
+            TElement *head;
+            TElement *tail;
+            // set when node will produce no more elements
+            bool exhausted;
+            long long left;
+            long long right;
+        };
+
+        bool CompareElements(const TElement &one, const TElement &other) const {
+            return TComparator() (one, other);
+        }
+
+        // Fills buffer of the node from its children until it is full or children are exhausted
+        void Fill(Node &node);
+        // Adds nodes of subtree with root root_index and internal height height to nodes_,
+        // and reserves buffers for its edges in buffer_sizes_
+        void Layout(long long root_index, int height);
+
+        int height_;
+        std::vector<Node> nodes_;
+        // position in nodes_ of every node, indexed like a binary heap with root 1
+        std::vector<long long> node_positions_;
+        // buffer size of every node in the order of layout, root has no buffer of its own
+        std::vector<std::pair<long long, long long>> buffer_sizes_;
+        std::vector<TElement> buffers_;
+};
+
+// Sorts array [begin, end) with lazy funnelsort
+// Temp must point to scratch space for end - begin elements
+template <typename TElement, typename TComparator = std::less<TElement>>
+void FunnelSort(TElement *begin, TElement *end, TElement *temp) {
+    long long size = end - begin;
+    if (size <= FUNNEL_SORT_BASE_SIZE) {
+        std::sort(begin, end, TComparator());
+        return;
+    }
+
+    // n^(1/3) segments of size n^(2/3) each
+    long long segments_count = std::max(2LL, (long long) ceil(cbrt(double(size))));
+    long long segment_size = (size + segments_count - 1) / segments_count;
+
+    std::vector<std::pair<TElement *, TElement *>> segments;
+    for (long long segment_begin = 0; segment_begin < size; segment_begin += segment_size) {
+        long long segment_end = std::min(size, segment_begin + segment_size);
+        FunnelSort<TElement, TComparator>(begin + segment_begin, begin + segment_end, temp + segment_begin);
+        segments.push_back(std::make_pair(begin + segment_begin, begin + segment_end));
+    }
+
+    Funnel<TElement, TComparator> funnel(segments);
+    funnel.Merge(temp);
+    std::copy(temp, temp + size, begin);
+}
+
+template<typename TElement, typename TComparator>
+Funnel<TElement, TComparator>::Funnel(const std::vector<std::pair<TElement *, TElement *>> &inputs) :
+        height_(1) {
+    while ((1LL << height_) < (long long) inputs.size()) {
+        ++height_;
+    }
+    node_positions_.assign(1LL << (height_ + 1), -1);
+    Layout(1, height_);
+
+    long long buffers_size = 0;
+    for (auto buffer_size: buffer_sizes_) {
+        buffers_size += buffer_size.second;
+    }
+    buffers_.resize(buffers_size);
+
+    TElement *buffer = buffers_.data();
+    for (auto buffer_size: buffer_sizes_) {
+        Node &node = nodes_[buffer_size.first];
+        node.buffer_begin = node.head = node.tail = buffer;
+        buffer += buffer_size.second;
+        node.buffer_end = buffer;
+    }
+
+    long long first_leaf = 1LL << height_;
+    for (long long index = 1; index < first_leaf * 2; ++index) {
+        Node &node = nodes_[node_positions_[index]];
+        if (index < first_leaf) {
+            node.left = node_positions_[index * 2];
+            node.right = node_positions_[index * 2 + 1];
+        } else if (index - first_leaf < (long long) inputs.size()) {
+            node.head = inputs[index - first_leaf].first;
+            node.tail = inputs[index - first_leaf].second;
+        }
+    }
+}
+
+template<typename TElement, typename TComparator>
+void Funnel<TElement, TComparator>::Layout(long long root_index, int height) {
+    Node empty_node = {nullptr, nullptr, nullptr, nullptr, false, -1, -1};
+
+    if (height == 1) {
+        node_positions_[root_index] = nodes_.size();
+        nodes_.push_back(empty_node);
+
+        long long first_leaf = 1LL << height_;
+        if (root_index * 2 >= first_leaf) {
+            // leaves are input arrays, they can't be refilled
+            empty_node.exhausted = true;
+            for (long long leaf_index = root_index * 2; leaf_index <= root_index * 2 + 1; ++leaf_index) {
+                node_positions_[leaf_index] = nodes_.size();
+                nodes_.push_back(empty_node);
+            }
+        }
+        return;
+    }
+
+    int top_height = height / 2;
+    int bottom_height = height - top_height;
+    long long buffer_size = ceil(pow(double(1LL << height), 1.5));
+
+    Layout(root_index, top_height);
+    long long bottom_roots_begin = root_index << top_height;
+    for (long long bottom_root = bottom_roots_begin; bottom_root < bottom_roots_begin + (1LL << top_height); ++bottom_root) {
+        buffer_sizes_.push_back(std::make_pair((long long) nodes_.size(), buffer_size));
+        Layout(bottom_root, bottom_height);
+    }
+}
+
+template<typename TElement, typename TComparator>
+void Funnel<TElement, TComparator>::Merge(TElement *output) {
+    Node &root = nodes_[node_positions_[1]];
+    long long size = 0;
+    for (long long leaf = 1LL << height_; leaf < 1LL << (height_ + 1); ++leaf) {
+        const Node &node = nodes_[node_positions_[leaf]];
+        size += node.tail - node.head;
+    }
+
+    root.buffer_begin = output;
+    root.buffer_end = output + size;
+    Fill(root);
+}
+
+template<typename TElement, typename TComparator>
+void Funnel<TElement, TComparator>::Fill(Node &node) {
+    Node &left = nodes_[node.left];
+    Node &right = nodes_[node.right];
+    TElement *output = node.buffer_begin;
+
+    while (output != node.buffer_end) {
+        if (left.head == left.tail && !left.exhausted) {
+            Fill(left);
+        }
+        if (right.head == right.tail && !right.exhausted) {
+            Fill(right);
+        }
+
+        bool left_empty = (left.head == left.tail);
+        bool right_empty = (right.head == right.tail);
+        if (left_empty && right_empty) {
+            node.exhausted = true;
+            break;
+        }
+
+        if (left_empty || right_empty) {
+            Node &rest = left_empty ? right : left;
+            long long count = std::min(rest.tail - rest.head, node.buffer_end - output);
+            output = std::copy(rest.head, rest.head + count, output);
+            rest.head += count;
+        } else {
+            while (left.head != left.tail && right.head != right.tail && output != node.buffer_end) {
+                if (CompareElements(*right.head, *left.head)) {
+                    *output++ = *right.head++;
+                } else {
+                    *output++ = *left.head++;
+                }
+            }
+        }
+    }
+
+    node.head = node.buffer_begin;
+    node.tail = output;
+}
+
+} // namespace algorithms
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <new>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of a huge page on x86-64 and of a transparent huge page on most platforms
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024; // 2 MB
+// Memory of MemoryArena is given out in multiples of this size
+const size_t ARENA_ALIGNMENT = 64;
+
+inline size_t GetHugePagesSize(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// Starts of mappings made with MAP_HUGETLB, pages of which can be released only in whole huge pages
+class HugeTlbMappings {
+public:
+    static void Add(const void *data) {
+        HugeTlbMappings &mappings = GetInstance();
+        std::lock_guard<std::mutex> lock(mappings.mutex_);
+        mappings.starts_.insert(data);
+    }
+
+    static void Remove(const void *data) {
+        HugeTlbMappings &mappings = GetInstance();
+        std::lock_guard<std::mutex> lock(mappings.mutex_);
+        mappings.starts_.erase(data);
+    }
+
+    static bool Contains(const void *data) {
+        HugeTlbMappings &mappings = GetInstance();
+        std::lock_guard<std::mutex> lock(mappings.mutex_);
+        return mappings.starts_.count(data) > 0;
+    }
+
+private:
+    static HugeTlbMappings &GetInstance() {
+        static HugeTlbMappings mappings;
+        return mappings;
+    }
+
+    std::mutex mutex_;
+    std::set<const void *> starts_;
+};
+
+// Maps memory of size bytes with MAP_HUGETLB if the huge page pool has enough pages,
+// otherwise maps it aligned to HUGE_PAGE_SIZE and advises it with MADV_HUGEPAGE to get transparent huge pages
+inline void *MapHugePages(size_t size) {
+    size_t mapped_size = GetHugePagesSize(size);
+    void *data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+        HugeTlbMappings::Add(data);
+        return data;
+    }
+
+    // transparent huge pages are used only for parts of the mapping aligned to huge pages
+    char *unaligned = (char *) mmap(nullptr, mapped_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unaligned == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    char *aligned = (char *) (((uintptr_t) unaligned + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    if (aligned > unaligned) {
+        munmap(unaligned, aligned - unaligned);
+    }
+    munmap(aligned + mapped_size, unaligned + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, mapped_size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+inline void UnmapHugePages(void *data, size_t size) {
+    HugeTlbMappings::Remove(data);
+    munmap(data, GetHugePagesSize(size));
+}
+
+// One region of memory from which all buffers of values are allocated once it is created,
+// so that memory used by buffers never exceeds its size, and allocation which doesn't fit throws instead
+// Region is mapped on huge pages and touched when it is created, so later passes of a sort reuse the same pages
+// without faulting and zeroing them again
+// Free parts are kept ordered by offset and merged with free neighbours, allocation takes the smallest one which fits,
+// so that big free parts are kept for big buffers
+// Besides the arena of the process, a thread can allocate from an arena of its own, see MemoryArenaScope
+class MemoryArena {
+public:
+    explicit MemoryArena(long long size) :
+        data_((char *) MapHugePages(size)),
+        size_(size)
+    {
+        memset(data_, 0, size_);
+        free_ranges_[0] = size_;
+    }
+
+    // Creates the arena of the process of size bytes, must be called before any buffer is allocated
+    static void Create(long long size) {
+        GetInstance().reset(new MemoryArena(size));
+    }
+
+    // Returns the arena of the calling thread if it has one, otherwise the arena of the process,
+    // or nullptr if it is not created
+    static MemoryArena *Get() {
+        MemoryArena *thread_arena = GetThreadArena();
+        return thread_arena != nullptr ? thread_arena : GetInstance().get();
+    }
+
+    // Arena set for the calling thread by MemoryArenaScope, or nullptr
+    static MemoryArena *&GetThreadArena() {
+        static thread_local MemoryArena *arena = nullptr;
+        return arena;
+    }
+
+    ~MemoryArena() {
+        UnmapHugePages(data_, size_);
+    }
+
+    MemoryArena(const MemoryArena &) = delete;
+    MemoryArena &operator = (const MemoryArena &) = delete;
+
+    void *Allocate(size_t size) {
+        size = GetArenaSize(size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto best_range = free_ranges_.end();
+        for (auto range = free_ranges_.begin(); range != free_ranges_.end(); ++range) {
+            if (range->second >= size && (best_range == free_ranges_.end() || range->second < best_range->second)) {
+                best_range = range;
+            }
+        }
+        if (best_range != free_ranges_.end()) {
+            size_t offset = best_range->first;
+            size_t range_size = best_range->second;
+            free_ranges_.erase(best_range);
+            if (range_size > size) {
+                free_ranges_[offset + size] = range_size - size;
+            }
+            return data_ + offset;
+        }
+        throw std::runtime_error("Buffers don't fit into memory cap of " + std::to_string(size_) + " bytes");
+    }
+
+    void Deallocate(void *data, size_t size) {
+        size_t offset = (char *) data - data_;
+        size = GetArenaSize(size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto range = free_ranges_.insert(std::make_pair(offset, size)).first;
+        auto next = std::next(range);
+        if (next != free_ranges_.end() && range->first + range->second == next->first) {
+            range->second += next->second;
+            free_ranges_.erase(next);
+        }
+        if (range != free_ranges_.begin()) {
+            auto previous = std::prev(range);
+            if (previous->first + previous->second == range->first) {
+                previous->second += range->second;
+                free_ranges_.erase(range);
+            }
+        }
+    }
+
+private:
+    static std::unique_ptr<MemoryArena> &GetInstance() {
+        static std::unique_ptr<MemoryArena> arena;
+        return arena;
+    }
+
+    static size_t GetArenaSize(size_t size) {
+        return std::max<size_t>(1, (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT) * ARENA_ALIGNMENT;
+    }
+
+    char *data_;
+    size_t size_;
+    std::mutex mutex_;
+    // size of every free range by its offset
+    std::map<size_t, size_t> free_ranges_;
+};
+
+// Makes the calling thread allocate buffers from arena until the scope ends, nullptr keeps the arena of the process
+// Buffers must be freed by threads of the same arena, so a sort passes its arena to every thread it starts
+class MemoryArenaScope {
+public:
+    explicit MemoryArenaScope(MemoryArena *arena) :
+        previous_arena_(MemoryArena::GetThreadArena())
+    {
+        MemoryArena::GetThreadArena() = arena;
+    }
+
+    ~MemoryArenaScope() {
+        MemoryArena::GetThreadArena() = previous_arena_;
+    }
+
+    MemoryArenaScope(const MemoryArenaScope &) = delete;
+    MemoryArenaScope &operator = (const MemoryArenaScope &) = delete;
+
+private:
+    MemoryArena *previous_arena_;
+};
+
+// Allocator of big buffers backed by huge pages, so that random accesses of sorting miss TLB less often
+// Buffers are allocated from MemoryArena if it is created, otherwise memory of at least HUGE_PAGE_SIZE bytes
+// is mapped with MapHugePages, and smaller memory is allocated with operator new
+// Values are not initialized when a buffer is created or resized, so it must be filled before it is read
+template <typename T>
+class HugePageAllocator {
+public:
+    typedef T value_type;
+
+    HugePageAllocator() {}
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T *allocate(size_t count) {
+        size_t size = count * sizeof(T);
+        if (MemoryArena::Get() != nullptr) {
+            return (T *) MemoryArena::Get()->Allocate(size);
+        }
+        if (size < HUGE_PAGE_SIZE) {
+            return (T *) ::operator new(size);
+        }
+        return (T *) MapHugePages(size);
+    }
+
+    void deallocate(T *data, size_t count) {
+        size_t size = count * sizeof(T);
+        if (MemoryArena::Get() != nullptr) {
+            MemoryArena::Get()->Deallocate(data, size);
+        } else if (size < HUGE_PAGE_SIZE) {
+            ::operator delete(data);
+        } else {
+            UnmapHugePages(data, size);
+        }
+    }
+
+    template <typename U>
+    void construct(U *data) {
+        ::new ((void *) data) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *data, Args &&... args) {
+        ::new ((void *) data) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator == (const HugePageAllocator<T> &, const HugePageAllocator<U> &) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator != (const HugePageAllocator<T> &, const HugePageAllocator<U> &) {
+    return false;
+}
+
+// Buffer of values for sorting in memory and for reading and writing runs
+typedef std::vector<uint64_t, HugePageAllocator<uint64_t>> ValueBuffer;
+
+// Releases pages of buffer after its first count values, they are allocated again when they are written,
+// so that a buffer which is used only in part doesn't hold memory of the rest
+// Pages of MemoryArena are kept
+// Buffer mapped with MAP_HUGETLB is released in whole huge pages, up to the end of its mapping
+// Releasing is only advice: kernels before 5.18 can't release huge pages of MAP_HUGETLB, and then the pages are kept
+inline void ReleaseValues(ValueBuffer *buffer, size_t count) {
+    if (MemoryArena::Get() != nullptr || count >= buffer->size()) {
+        return;
+    }
+    bool huge_tlb = HugeTlbMappings::Contains(buffer->data());
+    uintptr_t page_size = (huge_tlb ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE));
+    uintptr_t begin = ((uintptr_t) (buffer->data() + count) + page_size - 1) / page_size * page_size;
+    uintptr_t end = (uintptr_t) (buffer->data() + buffer->size());
+    end = (huge_tlb ? (end + page_size - 1) : end) / page_size * page_size;
+    if (begin < end) {
+        madvise((void *) begin, end - begin, MADV_DONTNEED);
+    }
+}
@@ -0,0 +1,74 @@
+// Sorts several binary files into one output file.
+// Every input file is read by its own thread, which pushes values into ConcurrentIngestion.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <exception>
+#include <tclap/CmdLine.h>
+#include "concurrent_ingestion.hpp"
+
+const int DEFAULT_BLOCK_SIZE = 1024 * 1024 * 1024; // 1 GB
+const int DEFAULT_BRANCHING_DEGREE = 8;
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Sorting values of several producers in external memory", ' ', "1.0");
+        TCLAP::ValueArg<int> block_size_arg("b", "block_size", "Size of memory shared by all producers (in bytes)", false, DEFAULT_BLOCK_SIZE, "integer");
+        TCLAP::ValueArg<int> branching_degree_arg("d", "branching", "Branching degree", false, DEFAULT_BRANCHING_DEGREE, "integer");
+        TCLAP::UnlabeledValueArg<std::string> output_file_arg("output_file", "Output file name", true, "", "nameString");
+        TCLAP::UnlabeledMultiArg<std::string> input_files_arg("input_files", "Input file names, one producer thread per file", true, "nameString");
+        cmd.add(block_size_arg);
+        cmd.add(branching_degree_arg);
+        cmd.add(output_file_arg);
+        cmd.add(input_files_arg);
+        cmd.parse(argc, argv);
+
+        std::string output_file = output_file_arg.getValue();
+        std::vector<std::string> input_files = input_files_arg.getValue();
+        SortParameters parameters {block_size_arg.getValue(), branching_degree_arg.getValue(), NO_LIMIT, 1, NO_DEVICE_JOBS_LIMIT, false, false, 1, NO_INDEX, false, false, nullptr, false};
+
+        ConcurrentIngestion ingestion(output_file + "_tmp", parameters, input_files.size());
+        std::vector<std::thread> producer_threads;
+        std::vector<std::exception_ptr> errors(input_files.size());
+
+        for (size_t file_idx = 0; file_idx < input_files.size(); ++file_idx) {
+            ConcurrentIngestion::Producer *producer = ingestion.CreateProducer();
+            producer_threads.emplace_back([&input_files, &errors, producer, file_idx] () {
+                try {
+                    std::ifstream in_file(input_files[file_idx], std::ios_base::in | std::ios_base::binary);
+                    if (!in_file) {
+                        throw std::runtime_error("Can't open input file " + input_files[file_idx]);
+                    }
+                    std::vector<uint64_t> buffer(READ_BUFFER_SIZE / sizeof(uint64_t));
+                    while (in_file) {
+                        in_file.read((char *) &buffer[0], READ_BUFFER_SIZE);
+                        producer->Push(&buffer[0], in_file.gcount() / sizeof(uint64_t));
+                    }
+                    producer->Close();
+                } catch (...) {
+                    errors[file_idx] = std::current_exception();
+                }
+            });
+        }
+        for (std::thread &thread: producer_threads) {
+            thread.join();
+        }
+        for (std::exception_ptr error: errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        ingestion.Finish(output_file);
+    } catch (TCLAP::ArgException &arg) {
+        std::cerr << "Invalid arguments: " << arg.error() << "for arg " << arg.argId() << std::endl;
+        return 1;
+    } catch (std::runtime_error& err) {
+        std::cerr << "Runtime error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
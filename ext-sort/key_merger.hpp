@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include "binary_heap.hpp"
+#include "external_sort.hpp"
+#include "run_file.hpp"
+
+// Merges sorted runs key by key: every call of Next() moves to the next distinct value of all runs
+// and counts how many times it occurs in every run
+// Equal values of one run are counted with galloping search, so long ranges of duplicates cost few comparisons
+class KeyMerger {
+public:
+    explicit KeyMerger(const std::vector<RunReader *> &runs) :
+        runs_(runs),
+        counts_(runs.size(), 0),
+        key_(0)
+    {
+        for (size_t run_idx = 0; run_idx < runs_.size(); ++run_idx) {
+            if (runs_[run_idx]->HasValue()) {
+                heads_.Insert(Head(runs_[run_idx]->GetValue(), run_idx));
+            }
+        }
+    }
+
+    // Moves to the next key, returns false if all runs are over
+    bool Next() {
+        if (heads_.GetSize() == 0) {
+            return false;
+        }
+        std::fill(counts_.begin(), counts_.end(), 0);
+        key_ = heads_.GetTop().first;
+
+        while (heads_.GetSize() > 0 && heads_.GetTop().first == key_) {
+            size_t run_idx = heads_.GetTop().second;
+            RunReader *run = runs_[run_idx];
+            while (run->HasValue()) {
+                size_t count = run->GetBufferedCount();
+                size_t equal_count = GallopUpperBound(run->GetBufferedValues(), count, key_);
+                counts_[run_idx] += equal_count;
+                run->Skip(equal_count);
+                if (equal_count < count) {
+                    break;
+                }
+            }
+
+            if (run->HasValue()) {
+                heads_.ReplaceTop(Head(run->GetValue(), run_idx));
+            } else {
+                heads_.Pop();
+            }
+        }
+        return true;
+    }
+
+    uint64_t GetKey() const {
+        return key_;
+    }
+
+    // Number of occurrences of the key in every run, in the order of runs
+    const std::vector<uint64_t> &GetCounts() const {
+        return counts_;
+    }
+
+private:
+    // current value of a run and index of the run
+    typedef std::pair<uint64_t, size_t> Head;
+
+    std::vector<RunReader *> runs_;
+    algorithms::BinaryHeap<Head, std::greater<Head>> heads_;
+    std::vector<uint64_t> counts_;
+    uint64_t key_;
+};
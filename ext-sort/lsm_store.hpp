@@ -0,0 +1,207 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "external_sort.hpp"
+#include "run_file.hpp"
+
+const std::string LSM_MANIFEST_NAME = "MANIFEST";
+
+// Sorted file kept up to date under appended batches, in the manner of a log-structured merge tree
+// Store is a directory with sorted runs (see run_file.hpp) and MANIFEST listing them with their levels
+// Every batch is sorted on its own into a run of level 0, and whenever a level gets branching degree runs,
+// they are merged into one run of the next level (size-tiered compaction),
+// so every value is merged once per level, and the number of levels is logarithmic in the store size
+// Manifest is replaced atomically after every change, files not listed in it are leftovers of a failed change
+// New runs, new manifest and the directory are synced to disk before the change is complete,
+// so after a crash manifest lists only intact runs, and a leftover may be overwritten by the next change
+class LsmStore {
+public:
+    LsmStore(std::string directory, const SortParameters &parameters) :
+        directory_(directory),
+        parameters_(parameters),
+        next_run_number_(0)
+    {
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Can't create store directory " + directory);
+        }
+        ReadManifest();
+    }
+
+    // Sorts batch file into a new run and compacts levels which got too many runs
+    void AddBatch(std::string batch_file_name) {
+        std::string run_file_name = GetNewRunFileName();
+        SortParameters batch_parameters = parameters_;
+        batch_parameters.output_footer = true;
+        ExternalMergeSort(batch_file_name, GetPath(run_file_name), batch_parameters);
+
+        if (RunReader(GetPath(run_file_name), 1, false).GetFooter().count == 0) {
+            ::remove(GetPath(run_file_name).c_str());
+            return;
+        }
+        SyncFile(GetPath(run_file_name));
+        runs_.push_back(Run {0, run_file_name});
+        WriteManifest();
+        CompactLevels();
+    }
+
+    // Merges all runs into one run, so that the store is a single sorted base
+    void CompactAll() {
+        if (runs_.size() > 1) {
+            int top_level = 0;
+            for (const Run &run: runs_) {
+                top_level = std::max(top_level, run.level);
+            }
+            MergeIntoLevel(runs_, top_level + 1);
+        }
+    }
+
+    // Writes all values of the store into output file in sorted order
+    void Export(std::string output_file_name) const {
+        std::vector<std::string> run_paths;
+        for (const Run &run: runs_) {
+            run_paths.push_back(GetPath(run.file_name));
+        }
+        SortParameters export_parameters = parameters_;
+        export_parameters.output_footer = false;
+        MergeFiles(run_paths, output_file_name, export_parameters);
+    }
+
+    // Returns number of runs on every level
+    std::vector<int> GetLevelSizes() const {
+        std::vector<int> level_sizes;
+        for (const Run &run: runs_) {
+            if ((int) level_sizes.size() <= run.level) {
+                level_sizes.resize(run.level + 1, 0);
+            }
+            ++level_sizes[run.level];
+        }
+        return level_sizes;
+    }
+
+private:
+    struct Run {
+        int level;
+        std::string file_name;
+    };
+
+    void CompactLevels() {
+        for (int level = 0; ; ++level) {
+            std::vector<Run> level_runs;
+            bool has_higher_levels = false;
+            for (const Run &run: runs_) {
+                if (run.level == level) {
+                    level_runs.push_back(run);
+                }
+                has_higher_levels |= (run.level > level);
+            }
+            if ((int) level_runs.size() >= parameters_.branching_degree) {
+                MergeIntoLevel(level_runs, level + 1);
+            } else if (!has_higher_levels) {
+                break;
+            }
+        }
+    }
+
+    // Replaces runs with one run of the given level, which holds all their values
+    void MergeIntoLevel(const std::vector<Run> &runs, int level) {
+        std::vector<std::string> run_paths;
+        for (const Run &run: runs) {
+            run_paths.push_back(GetPath(run.file_name));
+        }
+        std::string merged_file_name = GetNewRunFileName();
+        SortParameters merge_parameters = parameters_;
+        merge_parameters.output_footer = true;
+        MergeFiles(run_paths, GetPath(merged_file_name), merge_parameters);
+        SyncFile(GetPath(merged_file_name));
+
+        std::vector<Run> remaining_runs;
+        for (const Run &run: runs_) {
+            bool merged = std::find_if(runs.begin(), runs.end(), [&run] (const Run &other) {
+                return other.file_name == run.file_name;
+            }) != runs.end();
+            if (!merged) {
+                remaining_runs.push_back(run);
+            }
+        }
+        remaining_runs.push_back(Run {level, merged_file_name});
+        runs_ = remaining_runs;
+        WriteManifest();
+
+        for (std::string run_path: run_paths) {
+            ::remove(run_path.c_str());
+        }
+    }
+
+    std::string GetPath(std::string file_name) const {
+        return directory_ + "/" + file_name;
+    }
+
+    std::string GetNewRunFileName() {
+        return "run" + std::to_string(next_run_number_++);
+    }
+
+    // Manifest holds number of the next run, then level and file name of every run, one run per line
+    void ReadManifest() {
+        std::ifstream manifest(GetPath(LSM_MANIFEST_NAME));
+        if (!manifest) {
+            return;
+        }
+        manifest >> next_run_number_;
+        Run run;
+        while (manifest >> run.level >> run.file_name) {
+            runs_.push_back(run);
+        }
+        if (!manifest.eof()) {
+            throw std::runtime_error("Manifest of store " + directory_ + " is corrupted");
+        }
+    }
+
+    void WriteManifest() {
+        std::string manifest_path = GetPath(LSM_MANIFEST_NAME);
+        std::string new_manifest_path = manifest_path + "_new";
+        {
+            std::ofstream manifest(new_manifest_path);
+            manifest << next_run_number_ << "\n";
+            for (const Run &run: runs_) {
+                manifest << run.level << " " << run.file_name << "\n";
+            }
+            manifest.flush();
+            if (!manifest) {
+                throw std::runtime_error("Can't write manifest of store " + directory_);
+            }
+        }
+        SyncFile(new_manifest_path);
+        if (rename(new_manifest_path.c_str(), manifest_path.c_str()) != 0) {
+            throw std::runtime_error("Can't write manifest of store " + directory_);
+        }
+        // rename is durable once the directory is synced
+        SyncFile(directory_);
+    }
+
+    // Flushes file or directory to disk
+    static void SyncFile(std::string file_name) {
+        int file_descriptor = open(file_name.c_str(), O_RDONLY);
+        bool synced = (file_descriptor >= 0 && fsync(file_descriptor) == 0);
+        if (file_descriptor >= 0) {
+            close(file_descriptor);
+        }
+        if (!synced) {
+            throw std::runtime_error("Can't sync file " + file_name);
+        }
+    }
+
+    std::string directory_;
+    SortParameters parameters_;
+    long long next_run_number_;
+    std::vector<Run> runs_;
+};
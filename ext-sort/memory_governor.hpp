@@ -0,0 +1,143 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+// Root of cgroup v2 hierarchy, cgroup of the process is found under it by /proc/self/cgroup
+const std::string CGROUP_ROOT = "/sys/fs/cgroup";
+// Percent of the last 10 seconds some tasks of the cgroup stalled on memory, above which memory use is cut
+const double HIGH_MEMORY_PRESSURE = 10.0;
+// Pressure below which memory use may grow again
+const double LOW_MEMORY_PRESSURE = 1.0;
+// Part of memory.max which is kept free, memory use is cut when less is left
+const double MEMORY_RESERVE_FRACTION = 0.1;
+// Smallest part of a block which is used under memory pressure
+const double MIN_BLOCK_FRACTION = 1.0 / 16;
+// Seconds between reads of cgroup files, runs and merges starting in between use the part found by the last read
+const double MEMORY_SAMPLE_INTERVAL = 1.0;
+
+// Adapts memory used by a sort to memory available in its cgroup (v2), which changes while the sort runs
+// Before every run is formed and every merge starts, at most once per MEMORY_SAMPLE_INTERVAL,
+// memory.pressure, memory.current, memory.stat and memory.max of the cgroup are read,
+// and the part of the block to use is halved when pressure is high
+// or less than MEMORY_RESERVE_FRACTION of memory.max is free, and doubled up to the whole block
+// when pressure is low and the cgroup has room for the doubled part
+// Inactive page cache (inactive_file of memory.stat) is counted as free, the kernel reclaims it first
+// Without cgroup v2 files the whole block is always used
+class MemoryGovernor {
+public:
+    // Starts adapting memory use of all sorts of the process
+    static void Create() {
+        GetInstance().reset(new MemoryGovernor());
+    }
+
+    // Returns the governor, or nullptr if memory use is not adapted
+    static MemoryGovernor *Get() {
+        return GetInstance().get();
+    }
+
+    // Returns number of bytes out of a block of block_size bytes to use for the next run or merge,
+    // a positive multiple of 8 bytes, can be called by concurrent sorts
+    long long GetUsableSize(long long block_size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Clock::time_point now = Clock::now();
+        if (sampled_ && std::chrono::duration<double>(now - sample_time_).count() < MEMORY_SAMPLE_INTERVAL) {
+            return GetPart(block_size);
+        }
+        sampled_ = true;
+        sample_time_ = now;
+
+        double pressure = ReadPressure();
+        long long current = ReadNumber("memory.current");
+        long long limit = ReadNumber("memory.max");
+        long long inactive_file = ReadStat("inactive_file");
+        long long used = (current >= 0 ? std::max(0LL, current - std::max(0LL, inactive_file)) : -1);
+        long long free_memory = (limit > 0 && used >= 0 ? limit - used : -1);
+
+        if (pressure > HIGH_MEMORY_PRESSURE || (free_memory >= 0 && free_memory < limit * MEMORY_RESERVE_FRACTION)) {
+            block_fraction_ = std::max(MIN_BLOCK_FRACTION, block_fraction_ / 2);
+        } else if (pressure < LOW_MEMORY_PRESSURE && block_fraction_ < 1 &&
+                   (free_memory < 0 || free_memory - limit * MEMORY_RESERVE_FRACTION > block_fraction_ * block_size)) {
+            block_fraction_ = std::min(1.0, block_fraction_ * 2);
+        }
+        return GetPart(block_size);
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    MemoryGovernor() :
+        block_fraction_(1),
+        sampled_(false)
+    {
+        // line of cgroup v2 looks like 0::/path/of/cgroup
+        std::ifstream cgroups("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(cgroups, line)) {
+            if (line.compare(0, 3, "0::") == 0) {
+                cgroup_directory_ = CGROUP_ROOT + line.substr(3);
+            }
+        }
+    }
+
+    static std::unique_ptr<MemoryGovernor> &GetInstance() {
+        static std::unique_ptr<MemoryGovernor> governor;
+        return governor;
+    }
+
+    // Returns number in the cgroup file, or -1 if there is no file or no limit ("max")
+    long long ReadNumber(std::string file_name) const {
+        std::ifstream file(cgroup_directory_ + "/" + file_name);
+        long long number = -1;
+        if (!(file >> number)) {
+            return -1;
+        }
+        return number;
+    }
+
+    // Returns value of the key in memory.stat of the cgroup, -1 if there is no file or no key
+    long long ReadStat(std::string key) const {
+        std::ifstream file(cgroup_directory_ + "/memory.stat");
+        std::string name;
+        long long value;
+        while (file >> name >> value) {
+            if (name == key) {
+                return value;
+            }
+        }
+        return -1;
+    }
+
+    // Returns block_fraction_ of a block of block_size bytes, a positive multiple of 8 bytes
+    long long GetPart(long long block_size) const {
+        return std::max(1LL, (long long) (block_size * block_fraction_) / 8) * 8;
+    }
+
+    // Returns avg10 of "some" line of memory.pressure, 0 if there is no file
+    double ReadPressure() const {
+        std::ifstream file(cgroup_directory_ + "/memory.pressure");
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string kind, average;
+            fields >> kind >> average;
+            if (kind == "some" && average.compare(0, 6, "avg10=") == 0) {
+                return std::stod(average.substr(6));
+            }
+        }
+        return 0;
+    }
+
+    std::mutex mutex_;
+    std::string cgroup_directory_;
+    // part of the block used by the next run or merge
+    double block_fraction_;
+    // whether cgroup files were read, and when they were read last
+    bool sampled_;
+    Clock::time_point sample_time_;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <utility>
+#include <cstdio>
+#include <dirent.h>
+#include <sched.h>
+
+const std::string NUMA_NODES_DIRECTORY = "/sys/devices/system/node";
+
+// NUMA nodes of the machine and their CPUs, as listed in /sys/devices/system/node
+// Nodes without CPUs are skipped, machine without NUMA information is one node,
+// and threads bound to it are not pinned
+class NumaTopology {
+public:
+    NumaTopology() {
+        std::vector<std::pair<int, std::vector<int>>> nodes;
+        DIR *directory = opendir(NUMA_NODES_DIRECTORY.c_str());
+        if (directory != nullptr) {
+            while (dirent *entry = readdir(directory)) {
+                int node;
+                char rest;
+                if (sscanf(entry->d_name, "node%d%c", &node, &rest) != 1) {
+                    continue;
+                }
+                std::ifstream cpu_list_file(NUMA_NODES_DIRECTORY + "/" + entry->d_name + "/cpulist");
+                std::string cpu_list;
+                std::getline(cpu_list_file, cpu_list);
+                std::vector<int> cpus = ParseCpuList(cpu_list);
+                if (!cpus.empty()) {
+                    nodes.push_back(std::make_pair(node, cpus));
+                }
+            }
+            closedir(directory);
+        }
+        std::sort(nodes.begin(), nodes.end());
+        for (const std::pair<int, std::vector<int>> &node: nodes) {
+            node_cpus_.push_back(node.second);
+        }
+        if (node_cpus_.empty()) {
+            node_cpus_.push_back(std::vector<int>());
+        }
+    }
+
+    int GetNodesCount() const {
+        return node_cpus_.size();
+    }
+
+    // Pins the calling thread to CPUs of node with index node modulo number of nodes,
+    // so that memory the thread touches first is allocated on that node
+    // Failure is ignored, the thread just runs where the scheduler puts it
+    void BindThread(int node) const {
+        const std::vector<int> &cpus = node_cpus_[node % node_cpus_.size()];
+        if (cpus.empty()) {
+            return;
+        }
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (int cpu: cpus) {
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+    }
+
+private:
+    // Parses list of CPU numbers and ranges like 0-3,8-11
+    static std::vector<int> ParseCpuList(std::string cpu_list) {
+        std::vector<int> cpus;
+        std::istringstream ranges(cpu_list);
+        std::string range;
+        while (std::getline(ranges, range, ',')) {
+            int first, last;
+            int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (fields == 1) {
+                last = first;
+            } else if (fields != 2) {
+                continue;
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // CPUs of every node, in the order of node numbers
+    std::vector<std::vector<int>> node_cpus_;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Hints which keep page cache used by big sequential reads and writes small,
+// so that sorting doesn't evict cache of other processes, and dirty pages don't pile up
+// Failed hints are ignored, they are no-ops for pipes and terminals
+
+// Size of parts of files which are flushed and dropped from page cache at once
+const long long PAGE_CACHE_WINDOW = 32 * 1024 * 1024; // 32 MB
+
+inline bool IsRegularFile(int file_descriptor) {
+    struct stat stat_buf;
+    return fstat(file_descriptor, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+}
+
+// Write-behind for a file written sequentially from offset:
+// writeback of every window is started as soon as the window is filled,
+// and the window before it is waited for and dropped from page cache,
+// so at most two windows of the file are dirty, and writes don't stall when the kernel flushes a pile of them
+class WriteBehind {
+public:
+    WriteBehind(int file_descriptor, long long offset) :
+        file_descriptor_(file_descriptor),
+        enabled_(IsRegularFile(file_descriptor)),
+        begin_(offset),
+        window_begin_(offset),
+        written_end_(offset)
+    {}
+
+    // Bytes written after the bytes passed before
+    void Advance(long long size) {
+        written_end_ += size;
+        while (enabled_ && written_end_ - window_begin_ >= PAGE_CACHE_WINDOW) {
+            sync_file_range(file_descriptor_, window_begin_, PAGE_CACHE_WINDOW, SYNC_FILE_RANGE_WRITE);
+            long long previous_window_begin = window_begin_ - PAGE_CACHE_WINDOW;
+            if (previous_window_begin >= begin_) {
+                sync_file_range(file_descriptor_, previous_window_begin, PAGE_CACHE_WINDOW,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(file_descriptor_, previous_window_begin, PAGE_CACHE_WINDOW, POSIX_FADV_DONTNEED);
+            }
+            window_begin_ += PAGE_CACHE_WINDOW;
+        }
+    }
+
+    // Starts writeback of the rest of written bytes, without waiting for it
+    void Finish() {
+        if (enabled_ && written_end_ > window_begin_) {
+            sync_file_range(file_descriptor_, window_begin_, written_end_ - window_begin_, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+
+private:
+    int file_descriptor_;
+    bool enabled_;
+    long long begin_;
+    // beginning of the window which is being filled
+    long long window_begin_;
+    long long written_end_;
+};
+
+// Read-behind for a file read sequentially from offset: pages which are consumed are dropped from page cache,
+// a window at a time, and readahead of the descriptor is increased
+// File can be given by name, to drop pages of a file read through a stream
+class ReadBehind {
+public:
+    ReadBehind(int file_descriptor, long long offset) :
+        file_descriptor_(file_descriptor),
+        owns_descriptor_(false),
+        released_end_(offset)
+    {
+        enabled_ = IsRegularFile(file_descriptor);
+        if (enabled_) {
+            posix_fadvise(file_descriptor_, offset, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    explicit ReadBehind(std::string file_name) :
+        file_descriptor_(open(file_name.c_str(), O_RDONLY)),
+        owns_descriptor_(true),
+        released_end_(0)
+    {
+        enabled_ = (file_descriptor_ >= 0 && IsRegularFile(file_descriptor_));
+    }
+
+    ~ReadBehind() {
+        if (owns_descriptor_ && file_descriptor_ >= 0) {
+            close(file_descriptor_);
+        }
+    }
+
+    ReadBehind(const ReadBehind &) = delete;
+    ReadBehind &operator = (const ReadBehind &) = delete;
+
+    // Bytes before end are consumed, drops whole windows of them
+    void Advance(long long end) {
+        Release(end / PAGE_CACHE_WINDOW * PAGE_CACHE_WINDOW);
+    }
+
+    // Bytes before end are consumed and won't be read again, drops all of them
+    void Finish(long long end) {
+        Release(end);
+    }
+
+private:
+    void Release(long long end) {
+        if (enabled_ && end > released_end_) {
+            posix_fadvise(file_descriptor_, released_end_, end - released_end_, POSIX_FADV_DONTNEED);
+            released_end_ = end;
+        }
+    }
+
+    int file_descriptor_;
+    bool owns_descriptor_;
+    bool enabled_;
+    long long released_end_;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <string>
+#include <ostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "sort_observer.hpp"
+
+// Reports progress of a sort every interval seconds, and once more when every phase ends
+// Line tells bytes read of the phase (out of its total, if known), bytes written, runs written,
+// rates of reading and writing since the previous line, and estimated time left until the sort ends
+// ETA assumes the rest of the sort goes at the average read rate of the current phase,
+// and that run formation and merge passes are followed by a final merge of as many bytes
+// Lines are written as text into text_out, or as JSON objects, one per line, into json_out
+class ProgressReporter : public SortObserver {
+public:
+    // input_size is size of the sorted input in bytes, -1 if unknown
+    ProgressReporter(long long input_size, double interval, std::ostream *text_out, std::ostream *json_out) :
+        input_size_(input_size),
+        interval_(interval),
+        text_out_(text_out),
+        json_out_(json_out),
+        start_time_(Clock::now()),
+        has_phase_(false),
+        stopped_(false)
+    {
+        StartPhase(SortPhase::FORM_RUNS, -1, -1);
+        thread_ = std::thread(&ProgressReporter::ReportPeriodically, this);
+    }
+
+    ~ProgressReporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        stop_.notify_all();
+        thread_.join();
+    }
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter &operator = (const ProgressReporter &) = delete;
+
+    void BeginPhase(SortPhase phase, long long bytes_count, long long runs_count) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        StartPhase(phase, bytes_count, runs_count);
+        has_phase_ = true;
+    }
+
+    void AddProgress(long long bytes_read, long long bytes_written) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytes_read_ += bytes_read;
+        bytes_written_ += bytes_written;
+    }
+
+    void AddRun() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++runs_done_;
+    }
+
+    void EndPhase(SortPhase) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Report(true);
+        has_phase_ = false;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void StartPhase(SortPhase phase, long long bytes_count, long long runs_count) {
+        phase_ = phase;
+        bytes_total_ = bytes_count;
+        runs_total_ = runs_count;
+        bytes_read_ = 0;
+        bytes_written_ = 0;
+        runs_done_ = 0;
+        phase_start_time_ = Clock::now();
+        last_report_time_ = phase_start_time_;
+        last_bytes_read_ = 0;
+        last_bytes_written_ = 0;
+    }
+
+    void ReportPeriodically() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(interval_));
+        while (!stop_.wait_for(lock, interval, [this] () { return stopped_; })) {
+            if (has_phase_) {
+                Report(false);
+            }
+        }
+    }
+
+    // Returns estimated seconds left until the sort ends, -1 if unknown, at rate bytes per second
+    double GetSecondsLeft(double rate) const {
+        long long merge_bytes = (phase_ == SortPhase::MERGE_PASS ? bytes_total_ : input_size_);
+        if (bytes_total_ < 0 || rate <= 0 || (phase_ != SortPhase::FINAL_MERGE && merge_bytes < 0)) {
+            return -1;
+        }
+        double bytes_left = std::max(0LL, bytes_total_ - bytes_read_);
+        if (phase_ != SortPhase::FINAL_MERGE) {
+            bytes_left += merge_bytes;
+        }
+        return bytes_left / rate;
+    }
+
+    // Writes line about the current phase, must be called under the mutex
+    void Report(bool phase_done) {
+        Clock::time_point now = Clock::now();
+        double elapsed = std::chrono::duration<double>(now - start_time_).count();
+        double phase_elapsed = std::chrono::duration<double>(now - phase_start_time_).count();
+        double since_last_report = std::chrono::duration<double>(now - last_report_time_).count();
+        const double MB = 1024 * 1024;
+        double read_rate = (since_last_report > 0 ? (bytes_read_ - last_bytes_read_) / since_last_report / MB : 0);
+        double write_rate = (since_last_report > 0 ? (bytes_written_ - last_bytes_written_) / since_last_report / MB : 0);
+        double seconds_left = GetSecondsLeft(phase_elapsed > 0 ? bytes_read_ / phase_elapsed : 0);
+        last_report_time_ = now;
+        last_bytes_read_ = bytes_read_;
+        last_bytes_written_ = bytes_written_;
+
+        if (text_out_ != nullptr) {
+            std::ostringstream line;
+            line << std::fixed << std::setprecision(1) << GetPhaseName(phase_) << (phase_done ? " done" : "") << ": "
+                 << bytes_read_ / MB;
+            if (bytes_total_ > 0) {
+                line << " of " << bytes_total_ / MB << " MB (" << 100.0 * bytes_read_ / bytes_total_ << "%)";
+            } else {
+                line << " MB";
+            }
+            line << " read, " << bytes_written_ / MB << " MB written, runs " << runs_done_;
+            if (runs_total_ >= 0) {
+                line << " of " << runs_total_;
+            }
+            line << ", in " << read_rate << " MB/s, out " << write_rate << " MB/s, ETA ";
+            if (seconds_left < 0) {
+                line << "unknown";
+            } else {
+                line << std::setprecision(0) << seconds_left << " s";
+            }
+            *text_out_ << line.str() << std::endl;
+        }
+        if (json_out_ != nullptr) {
+            std::ostringstream line;
+            line << std::fixed << std::setprecision(3)
+                 << "{\"elapsed\": " << elapsed
+                 << ", \"phase\": \"" << GetPhaseName(phase_) << "\""
+                 << ", \"phase_done\": " << (phase_done ? "true" : "false")
+                 << ", \"bytes_read\": " << bytes_read_
+                 << ", \"bytes_total\": " << bytes_total_
+                 << ", \"bytes_written\": " << bytes_written_
+                 << ", \"runs_done\": " << runs_done_
+                 << ", \"runs_total\": " << runs_total_
+                 << ", \"read_mb_per_second\": " << read_rate
+                 << ", \"write_mb_per_second\": " << write_rate
+                 << ", \"eta_seconds\": " << seconds_left << "}";
+            *json_out_ << line.str() << std::endl;
+        }
+    }
+
+    long long input_size_;
+    double interval_;
+    std::ostream *text_out_;
+    std::ostream *json_out_;
+    Clock::time_point start_time_;
+
+    std::mutex mutex_;
+    std::condition_variable stop_;
+    // current phase, and whether it has begun and not ended yet
+    SortPhase phase_;
+    bool has_phase_;
+    long long bytes_total_;
+    long long runs_total_;
+    long long bytes_read_;
+    long long bytes_written_;
+    long long runs_done_;
+    Clock::time_point phase_start_time_;
+    // counters when the previous line was written, rates are measured from them
+    Clock::time_point last_report_time_;
+    long long last_bytes_read_;
+    long long last_bytes_written_;
+    bool stopped_;
+    std::thread thread_;
+};
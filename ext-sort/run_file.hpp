@@ -0,0 +1,569 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "crc32c.hpp"
+#include "page_cache.hpp"
+#include "anonymous_files.hpp"
+#include "huge_page_allocator.hpp"
+#include "sort_observer.hpp"
+
+// Sorted run is a file with sorted 64bit values followed by RunFooter
+
+// File name which stands for standard input or standard output
+const std::string STANDARD_STREAM_NAME = "-";
+const long long WRITE_BUFFER_SIZE = 4 * 1024 * 1024; // 4 MB
+const uint64_t RUN_FOOTER_MAGIC = 0x314E55524F535845LLU; // "EXSORUN1"
+// Index past the last value of any run
+const uint64_t RUN_END = UINT64_MAX;
+
+// Formats of files read by RunReader
+enum RunFormat {
+    // sorted values followed by RunFooter
+    RUN_WITH_FOOTER,
+    // just sorted values, like output of ext_sort
+    SORTED_VALUES,
+    // like SORTED_VALUES, but order of values is checked while they are read
+    CHECKED_SORTED_VALUES
+};
+// Offset passed to RunWriter to create a new file
+const long long NEW_FILE = -1;
+// Offset passed to RunWriter to create a new temporary file without a name, see AnonymousFiles
+const long long ANONYMOUS_FILE = -2;
+
+struct RunFooter {
+    uint64_t magic;
+    // number of values in the run
+    uint64_t count;
+    uint64_t min_value;
+    uint64_t max_value;
+    // CRC32C of values
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+// Sparse index of a sorted file is a SparseIndexHeader followed by SparseIndexEntry
+// for every value with index divisible by the interval
+const uint64_t SPARSE_INDEX_MAGIC = 0x315844494F535845LLU; // "EXSOIDX1"
+const long long NO_INDEX = 0;
+
+struct SparseIndexHeader {
+    uint64_t magic;
+    // number of values between indexed values
+    uint64_t interval;
+    // number of values in the sorted file
+    uint64_t values_count;
+    uint64_t entries_count;
+};
+
+struct SparseIndexEntry {
+    uint64_t key;
+    // offset of the value in the sorted file, in bytes
+    uint64_t offset;
+};
+
+// Reads exactly size bytes from position offset of the file, throws on failure
+inline void ReadFully(int file_descriptor, void *data, long long size, long long offset) {
+    char *bytes = (char *) data;
+    while (size > 0) {
+        ssize_t bytes_read = pread(file_descriptor, bytes, size, offset);
+        if (bytes_read <= 0) {
+            throw std::runtime_error("Can't read from file");
+        }
+        bytes += bytes_read;
+        size -= bytes_read;
+        offset += bytes_read;
+    }
+}
+
+// Reserves disk space for size bytes from offset of the file, so that it is written into few contiguous extents,
+// file size is not changed, failure is ignored (e.g. file system doesn't support it)
+inline void PreallocateFile(int file_descriptor, long long offset, long long size) {
+    if (size > 0) {
+        fallocate(file_descriptor, FALLOC_FL_KEEP_SIZE, offset, size);
+    }
+}
+
+// Writes exactly size bytes to the file, throws on failure
+inline void WriteFully(int file_descriptor, const void *data, long long size) {
+    const char *bytes = (const char *) data;
+    while (size > 0) {
+        ssize_t bytes_written = write(file_descriptor, bytes, size);
+        if (bytes_written <= 0) {
+            throw std::runtime_error("Can't write to file");
+        }
+        bytes += bytes_written;
+        size -= bytes_written;
+    }
+}
+
+// Writes sparse index of values of a sorted file, as they are written
+class SparseIndexWriter {
+public:
+    SparseIndexWriter(std::string file_name, long long interval) :
+        header_ {SPARSE_INDEX_MAGIC, (uint64_t) interval, 0, 0}
+    {
+        file_descriptor_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file_descriptor_ < 0) {
+            throw std::runtime_error("Can't create index file " + file_name);
+        }
+        // header is rewritten by Close(), when numbers of values and entries are known
+        WriteFully(file_descriptor_, &header_, sizeof(header_));
+    }
+
+    ~SparseIndexWriter() {
+        close(file_descriptor_);
+    }
+
+    SparseIndexWriter(const SparseIndexWriter &) = delete;
+    SparseIndexWriter &operator = (const SparseIndexWriter &) = delete;
+
+    // Adds values which follow the values added before
+    void Add(const uint64_t *values, size_t count) {
+        uint64_t first_index = (header_.values_count + header_.interval - 1) / header_.interval * header_.interval;
+        for (uint64_t index = first_index; index < header_.values_count + count; index += header_.interval) {
+            entries_.push_back(SparseIndexEntry {values[index - header_.values_count], index * sizeof(uint64_t)});
+        }
+        header_.values_count += count;
+        if (entries_.size() * sizeof(SparseIndexEntry) >= (size_t) WRITE_BUFFER_SIZE) {
+            Flush();
+        }
+    }
+
+    void Close() {
+        Flush();
+        if (lseek(file_descriptor_, 0, SEEK_SET) != 0) {
+            throw std::runtime_error("Can't write index file");
+        }
+        WriteFully(file_descriptor_, &header_, sizeof(header_));
+    }
+
+private:
+    void Flush() {
+        WriteFully(file_descriptor_, entries_.data(), entries_.size() * sizeof(SparseIndexEntry));
+        header_.entries_count += entries_.size();
+        entries_.clear();
+    }
+
+    int file_descriptor_;
+    SparseIndexHeader header_;
+    std::vector<SparseIndexEntry> entries_;
+};
+
+// Writes sorted values into a run file, or into standard output for STANDARD_STREAM_NAME
+// Values are collected in a buffer of WRITE_BUFFER_SIZE bytes and written in big chunks
+// Run footer is written only if with_footer is set, otherwise the file holds just the values
+// If offset is not NEW_FILE, values are written into existing file starting from offset in bytes,
+// so that several writers can fill different parts of one file
+// If offset is ANONYMOUS_FILE, values are written into a new anonymous run registered under file_name,
+// at the end of a container file shared with other runs, see AnonymousFiles
+// Written values are flushed to disk and dropped from page cache behind the writer, see WriteBehind
+// Values are reported to the observer set with ReportProgress as they are written
+class RunWriter {
+public:
+    RunWriter(std::string file_name, bool with_footer, long long offset = NEW_FILE) :
+        with_footer_(with_footer),
+        footer_ {RUN_FOOTER_MAGIC, 0, 0, 0, 0, 0},
+        buffer_(WRITE_BUFFER_SIZE / sizeof(uint64_t)),
+        buffer_filled_(0),
+        position_(offset < 0 ? 0 : offset),
+        preallocated_end_(0),
+        truncate_(offset < 0),
+        owns_descriptor_(true),
+        observer_(nullptr),
+        merged_(false),
+        write_behind_(-1, 0)
+    {
+        if (file_name == STANDARD_STREAM_NAME) {
+            file_descriptor_ = STDOUT_FILENO;
+            truncate_ = false;
+            owns_descriptor_ = false;
+        } else if (offset == NEW_FILE) {
+            file_descriptor_ = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        } else if (offset == ANONYMOUS_FILE) {
+            FileExtent extent = AnonymousFiles::Create(file_name);
+            file_descriptor_ = extent.file_descriptor;
+            position_ = extent.offset;
+            truncate_ = false;
+            owns_descriptor_ = false;
+            if (file_descriptor_ >= 0) {
+                anonymous_file_name_ = file_name;
+                if (lseek(file_descriptor_, position_, SEEK_SET) != position_) {
+                    AnonymousFiles::Finish(file_name, 0);
+                    file_descriptor_ = -1;
+                }
+            }
+        } else {
+            file_descriptor_ = open(file_name.c_str(), O_WRONLY);
+            if (file_descriptor_ >= 0 && lseek(file_descriptor_, offset, SEEK_SET) != offset) {
+                close(file_descriptor_);
+                file_descriptor_ = -1;
+            }
+        }
+        if (file_descriptor_ < 0) {
+            throw std::runtime_error("Can't create file " + file_name);
+        }
+        begin_ = position_;
+        write_behind_ = WriteBehind(file_descriptor_, position_);
+    }
+
+    ~RunWriter() {
+        // anonymous run which is not closed keeps what was written, so that its container is free for other runs
+        FinishAnonymousRun();
+        if (owns_descriptor_) {
+            close(file_descriptor_);
+        }
+    }
+
+    RunWriter(const RunWriter &) = delete;
+    RunWriter &operator = (const RunWriter &) = delete;
+
+    void Write(uint64_t value) {
+        if (footer_.count++ == 0) {
+            footer_.min_value = value;
+        }
+        footer_.max_value = value;
+        buffer_[buffer_filled_++] = value;
+        if (buffer_filled_ == buffer_.size()) {
+            Flush();
+        }
+    }
+
+    void Write(const uint64_t *values, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        if (footer_.count == 0) {
+            footer_.min_value = values[0];
+        }
+        footer_.max_value = values[count - 1];
+        footer_.count += count;
+
+        // buffer is never left full, Write(value) relies on that
+        if (buffer_filled_ + count >= buffer_.size()) {
+            Flush();
+        }
+        if (count < buffer_.size()) {
+            std::copy(values, values + count, buffer_.begin() + buffer_filled_);
+            buffer_filled_ += count;
+        } else {
+            // values which don't fit into the buffer are written without copying
+            WriteValues(values, count);
+        }
+    }
+
+    void Close() {
+        Flush();
+        if (with_footer_) {
+            WriteFully(file_descriptor_, &footer_, sizeof(footer_));
+            write_behind_.Advance(sizeof(footer_));
+            position_ += sizeof(footer_);
+        }
+        // space reserved past the end of a new file is released
+        if (truncate_ && preallocated_end_ > position_ && ftruncate(file_descriptor_, position_) != 0) {
+            throw std::runtime_error("Can't write to file");
+        }
+        write_behind_.Finish();
+        FinishAnonymousRun();
+        if (index_) {
+            index_->Close();
+        }
+    }
+
+    const RunFooter &GetFooter() const {
+        return footer_;
+    }
+
+    // Reserves disk space for size bytes which are going to be written, see PreallocateFile
+    void Preallocate(long long size) {
+        if (file_descriptor_ != STDOUT_FILENO) {
+            PreallocateFile(file_descriptor_, position_, size);
+            preallocated_end_ = std::max(preallocated_end_, position_ + size);
+        }
+    }
+
+    // Reports bytes of written values to observer, also as read bytes if merged is set,
+    // because values merged from runs are read just once
+    void ReportProgress(SortObserver *observer, bool merged) {
+        observer_ = observer;
+        merged_ = merged;
+    }
+
+    // Writes sparse index with every interval-th value into index file, must be called before values are written
+    void WriteSparseIndex(std::string index_file_name, long long interval) {
+        index_.reset(new SparseIndexWriter(index_file_name, interval));
+    }
+
+private:
+    void Flush() {
+        WriteValues(&buffer_[0], buffer_filled_);
+        buffer_filled_ = 0;
+    }
+
+    void FinishAnonymousRun() {
+        if (!anonymous_file_name_.empty()) {
+            AnonymousFiles::Finish(anonymous_file_name_, position_ - begin_);
+            anonymous_file_name_.clear();
+        }
+    }
+
+    void WriteValues(const uint64_t *values, size_t count) {
+        if (with_footer_) {
+            footer_.checksum = algorithms::Crc32c(footer_.checksum, values, count * sizeof(uint64_t));
+        }
+        if (index_) {
+            index_->Add(values, count);
+        }
+        WriteFully(file_descriptor_, values, count * sizeof(uint64_t));
+        write_behind_.Advance(count * sizeof(uint64_t));
+        position_ += count * sizeof(uint64_t);
+        if (observer_ != nullptr) {
+            observer_->AddProgress(merged_ ? count * sizeof(uint64_t) : 0, count * sizeof(uint64_t));
+        }
+    }
+
+    int file_descriptor_;
+    bool with_footer_;
+    RunFooter footer_;
+    ValueBuffer buffer_;
+    size_t buffer_filled_;
+    // offset in the file where the writer started, and after the written bytes
+    long long begin_;
+    long long position_;
+    long long preallocated_end_;
+    // whether the file is new, and its end is the end of written bytes
+    bool truncate_;
+    bool owns_descriptor_;
+    // name of anonymous run until it is finished
+    std::string anonymous_file_name_;
+    SortObserver *observer_;
+    bool merged_;
+    WriteBehind write_behind_;
+    std::unique_ptr<SparseIndexWriter> index_;
+};
+
+// Reads values of a run file through a buffer of buffer_size values
+// If verify is set, checks checksum of the run after all values are read
+// Files in SORTED_VALUES format get footer with count, minimum and maximum values, but no checksum to verify
+// Files in CHECKED_SORTED_VALUES format are checked to be sorted, reader throws when it meets a value out of order
+// Only values with indices in [range_begin, range_end) are read,
+// footer of such reader describes just these values, and their checksum is not checked
+// Values which are read into buffer are dropped from page cache behind the reader, see ReadBehind
+// Anonymous run is read with pread from its extent of the shared container, without a descriptor of its own
+class RunReader {
+public:
+    RunReader(std::string file_name, long long buffer_size, bool verify, RunFormat format = RUN_WITH_FOOTER,
+              uint64_t range_begin = 0, uint64_t range_end = RUN_END) :
+        file_name_(file_name),
+        buffer_(std::max(1LL, buffer_size)),
+        position_(0),
+        buffer_filled_(0),
+        values_read_(0),
+        range_end_(0),
+        verify_(verify),
+        checksum_(0),
+        check_order_(format == CHECKED_SORTED_VALUES),
+        has_previous_value_(false),
+        previous_value_(0)
+    {
+        FileExtent extent;
+        if (AnonymousFiles::Find(file_name, &extent)) {
+            file_descriptor_ = extent.file_descriptor;
+            owns_descriptor_ = false;
+            file_offset_ = extent.offset;
+            file_size_ = extent.size;
+        } else {
+            file_descriptor_ = open(file_name.c_str(), O_RDONLY);
+            owns_descriptor_ = true;
+            file_offset_ = 0;
+            struct stat stat_buf;
+            if (file_descriptor_ < 0 || fstat(file_descriptor_, &stat_buf) != 0) {
+                if (file_descriptor_ >= 0) {
+                    close(file_descriptor_);
+                }
+                throw std::runtime_error("Can't open run file " + file_name);
+            }
+            file_size_ = stat_buf.st_size;
+        }
+        try {
+            if (format == RUN_WITH_FOOTER) {
+                ReadFooter();
+            } else {
+                MakeFooter();
+            }
+            range_end_ = footer_.count;
+            if (range_begin != 0 || range_end < footer_.count) {
+                RestrictToRange(range_begin, range_end);
+            }
+            read_behind_.reset(new ReadBehind(file_descriptor_, file_offset_ + values_read_ * sizeof(uint64_t)));
+            ReadBuffer();
+        } catch (...) {
+            if (owns_descriptor_) {
+                close(file_descriptor_);
+            }
+            throw;
+        }
+    }
+
+    ~RunReader() {
+        if (owns_descriptor_) {
+            close(file_descriptor_);
+        }
+    }
+
+    RunReader(const RunReader &) = delete;
+    RunReader &operator = (const RunReader &) = delete;
+
+    const RunFooter &GetFooter() const {
+        return footer_;
+    }
+
+    bool HasValue() const {
+        return position_ < buffer_filled_;
+    }
+
+    uint64_t GetValue() const {
+        return buffer_[position_];
+    }
+
+    void Next() {
+        Skip(1);
+    }
+
+    // Number of values read into buffer and not consumed yet, starting from the current one
+    size_t GetBufferedCount() const {
+        return buffer_filled_ - position_;
+    }
+
+    const uint64_t *GetBufferedValues() const {
+        return &buffer_[position_];
+    }
+
+    // Consumes count values, count must not exceed GetBufferedCount()
+    void Skip(size_t count) {
+        position_ += count;
+        if (position_ == buffer_filled_) {
+            ReadBuffer();
+        }
+    }
+
+    // Returns value with index index of the whole run, reading it directly from the file
+    uint64_t ReadValue(uint64_t index) const {
+        uint64_t value;
+        ReadFully(file_descriptor_, &value, sizeof(value), file_offset_ + index * sizeof(uint64_t));
+        return value;
+    }
+
+    // Returns index of the first value of the run not less than value,
+    // binary search reads O(log count) values from the file
+    uint64_t LowerBound(uint64_t value) const {
+        uint64_t begin = 0;
+        uint64_t end = range_end_;
+        while (begin < end) {
+            uint64_t middle = begin + (end - begin) / 2;
+            if (ReadValue(middle) < value) {
+                begin = middle + 1;
+            } else {
+                end = middle;
+            }
+        }
+        return begin;
+    }
+
+private:
+    void ReadFooter() {
+        if (file_size_ < (long long) sizeof(footer_)) {
+            throw std::runtime_error("Run file " + file_name_ + " is corrupted");
+        }
+        ReadFully(file_descriptor_, &footer_, sizeof(footer_), file_offset_ + file_size_ - sizeof(footer_));
+        if (footer_.magic != RUN_FOOTER_MAGIC ||
+            footer_.count * sizeof(uint64_t) + sizeof(footer_) != (uint64_t) file_size_) {
+            throw std::runtime_error("Run file " + file_name_ + " is corrupted");
+        }
+    }
+
+    void MakeFooter() {
+        footer_ = RunFooter {RUN_FOOTER_MAGIC, file_size_ / sizeof(uint64_t), 0, 0, 0, 0};
+        if (footer_.count > 0) {
+            footer_.min_value = ReadValue(0);
+            footer_.max_value = ReadValue(footer_.count - 1);
+        }
+        verify_ = false;
+    }
+
+    void RestrictToRange(uint64_t begin, uint64_t end) {
+        range_end_ = std::min(end, footer_.count);
+        values_read_ = std::min(begin, range_end_);
+        footer_.count = range_end_ - values_read_;
+        if (footer_.count > 0) {
+            footer_.min_value = ReadValue(values_read_);
+            footer_.max_value = ReadValue(range_end_ - 1);
+        }
+        verify_ = false;
+        // order of the first value of the range is checked against the value before it
+        if (check_order_ && values_read_ > 0 && values_read_ < range_end_) {
+            previous_value_ = ReadValue(values_read_ - 1);
+            has_previous_value_ = true;
+        }
+    }
+
+    void CheckOrder() {
+        if ((has_previous_value_ && buffer_[0] < previous_value_) ||
+            !std::is_sorted(buffer_.begin(), buffer_.begin() + buffer_filled_)) {
+            throw std::runtime_error("File " + file_name_ + " is not sorted");
+        }
+        previous_value_ = buffer_[buffer_filled_ - 1];
+        has_previous_value_ = true;
+    }
+
+    void ReadBuffer() {
+        position_ = 0;
+        buffer_filled_ = std::min<uint64_t>(buffer_.size(), range_end_ - values_read_);
+        if (buffer_filled_ == 0) {
+            read_behind_->Finish(file_offset_ + range_end_ * sizeof(uint64_t));
+            if (verify_ && checksum_ != footer_.checksum) {
+                throw std::runtime_error("Run file " + file_name_ + " has wrong checksum");
+            }
+            return;
+        }
+
+        ReadFully(file_descriptor_, &buffer_[0], buffer_filled_ * sizeof(uint64_t), file_offset_ + values_read_ * sizeof(uint64_t));
+        if (verify_) {
+            checksum_ = algorithms::Crc32c(checksum_, &buffer_[0], buffer_filled_ * sizeof(uint64_t));
+        }
+        if (check_order_) {
+            CheckOrder();
+        }
+        values_read_ += buffer_filled_;
+        read_behind_->Advance(file_offset_ + values_read_ * sizeof(uint64_t));
+    }
+
+    std::string file_name_;
+    int file_descriptor_;
+    bool owns_descriptor_;
+    // offset and size of the run in the file
+    long long file_offset_;
+    long long file_size_;
+    RunFooter footer_;
+    ValueBuffer buffer_;
+    size_t position_;
+    size_t buffer_filled_;
+    // index of the value after the last one read into buffer
+    uint64_t values_read_;
+    uint64_t range_end_;
+    bool verify_;
+    uint32_t checksum_;
+    bool check_order_;
+    // last value read before the buffer, to check order of values
+    bool has_previous_value_;
+    uint64_t previous_value_;
+    std::unique_ptr<ReadBehind> read_behind_;
+};
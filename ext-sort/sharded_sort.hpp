@@ -0,0 +1,403 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "external_sort.hpp"
+#include "run_file.hpp"
+
+// Sends exactly size bytes into socket, throws if the other side is gone
+inline void SendFully(int connection, const void *data, size_t size) {
+    const char *bytes = (const char *) data;
+    while (size > 0) {
+        ssize_t bytes_sent = send(connection, bytes, size, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) {
+            throw std::runtime_error("Connection between shards is broken");
+        }
+        bytes += bytes_sent;
+        size -= bytes_sent;
+    }
+}
+
+// Receives exactly size bytes from socket, throws if the other side is gone
+inline void ReceiveFully(int connection, void *data, size_t size) {
+    char *bytes = (char *) data;
+    while (size > 0) {
+        ssize_t bytes_received = recv(connection, bytes, size, 0);
+        if (bytes_received <= 0) {
+            throw std::runtime_error("Connection between shards is broken");
+        }
+        bytes += bytes_received;
+        size -= bytes_received;
+    }
+}
+
+// Merge sort split between shards_count worker processes, which stand for nodes of a cluster,
+// and talk only over Unix sockets (a socket to the coordinator, and one to every other worker)
+// Every worker forms sorted runs from its slice of the input, and sends samples of its runs to the coordinator,
+// which chooses global splitters from samples of all workers, so the values are split into one range per worker
+// Every worker splits its runs at the splitters with binary search, sends every range to the worker which owns it
+// (as runs, so they are not merged twice), and merges its own range into its part of the output,
+// at the offset the coordinator computed from sizes of ranges of all workers
+// Every worker sorts within its part of the block, so block_size / shards_count is used by each of them
+class ShardedSort {
+public:
+    ShardedSort(std::string input_file, std::string output_file, const SortParameters &parameters, int shards_count) :
+        input_file_(input_file),
+        output_file_(output_file),
+        parameters_(parameters),
+        shards_count_(shards_count)
+    {
+        parameters_.block_size = std::max<long long>(sizeof(uint64_t), parameters.block_size / shards_count / sizeof(uint64_t) * sizeof(uint64_t));
+    }
+
+    // Forks workers and coordinates them, throws if any of them fails
+    void Sort() {
+        if (GetFileSize(input_file_) < 0) {
+            throw std::runtime_error("Can't open input file " + input_file_);
+        }
+
+        // sockets[shard][peer] is the end of shard for talking to peer, the coordinator has index shards_count_
+        std::vector<std::vector<int>> sockets(shards_count_ + 1, std::vector<int>(shards_count_ + 1, -1));
+        for (int shard = 0; shard <= shards_count_; ++shard) {
+            for (int peer = shard + 1; peer <= shards_count_; ++peer) {
+                int ends[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) != 0) {
+                    CloseSockets(sockets, -1);
+                    throw std::runtime_error("Can't create sockets between shards");
+                }
+                sockets[shard][peer] = ends[0];
+                sockets[peer][shard] = ends[1];
+            }
+        }
+
+        std::vector<pid_t> workers;
+        for (int shard = 0; shard < shards_count_; ++shard) {
+            pid_t worker = fork();
+            if (worker == 0) {
+                CloseSockets(sockets, shard);
+                int exit_code = 0;
+                try {
+                    RunWorker(shard, sockets[shard]);
+                } catch (std::exception &err) {
+                    std::cerr << "Shard " << shard << ": " << err.what() << std::endl;
+                    exit_code = 1;
+                }
+                _exit(exit_code);
+            }
+            if (worker < 0) {
+                CloseSockets(sockets, -1);
+                StopWorkers(workers);
+                throw std::runtime_error("Can't start shard worker");
+            }
+            workers.push_back(worker);
+        }
+        CloseSockets(sockets, shards_count_);
+
+        std::vector<int> connections(sockets[shards_count_].begin(), sockets[shards_count_].end() - 1);
+        try {
+            Coordinate(connections);
+        } catch (...) {
+            CloseSockets(sockets, -1);
+            StopWorkers(workers);
+            throw;
+        }
+        CloseSockets(sockets, -1);
+        bool failed = false;
+        for (pid_t worker: workers) {
+            int status;
+            if (waitpid(worker, &status, 0) != worker || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                failed = true;
+            }
+        }
+        if (failed) {
+            throw std::runtime_error("Shard worker failed");
+        }
+    }
+
+private:
+    // Closes all sockets except those of shard (all of them if shard is -1)
+    static void CloseSockets(std::vector<std::vector<int>> &sockets, int shard) {
+        for (int owner = 0; owner < (int) sockets.size(); ++owner) {
+            if (owner == shard) {
+                continue;
+            }
+            for (int &connection: sockets[owner]) {
+                if (connection >= 0) {
+                    close(connection);
+                    connection = -1;
+                }
+            }
+        }
+    }
+
+    static void StopWorkers(const std::vector<pid_t> &workers) {
+        for (pid_t worker: workers) {
+            kill(worker, SIGTERM);
+        }
+        for (pid_t worker: workers) {
+            waitpid(worker, nullptr, 0);
+        }
+    }
+
+    void Coordinate(const std::vector<int> &connections) {
+        std::vector<std::pair<uint64_t, double>> samples;
+        for (int connection: connections) {
+            uint64_t samples_count;
+            ReceiveFully(connection, &samples_count, sizeof(samples_count));
+            std::vector<std::pair<uint64_t, double>> worker_samples(samples_count);
+            ReceiveFully(connection, worker_samples.data(), samples_count * sizeof(worker_samples[0]));
+            samples.insert(samples.end(), worker_samples.begin(), worker_samples.end());
+        }
+        std::vector<uint64_t> splitters = ChooseSplitters(samples, shards_count_);
+        for (int connection: connections) {
+            SendFully(connection, splitters.data(), splitters.size() * sizeof(uint64_t));
+        }
+
+        // range_offsets[range] is offset of the range in the output
+        std::vector<uint64_t> range_offsets(shards_count_ + 1, 0);
+        for (int connection: connections) {
+            std::vector<uint64_t> range_sizes(shards_count_);
+            ReceiveFully(connection, range_sizes.data(), shards_count_ * sizeof(uint64_t));
+            for (int range = 0; range < shards_count_; ++range) {
+                range_offsets[range + 1] += range_sizes[range] * sizeof(uint64_t);
+            }
+        }
+        for (int range = 0; range < shards_count_; ++range) {
+            range_offsets[range + 1] += range_offsets[range];
+        }
+        CreateFileOfSize(output_file_, range_offsets[shards_count_]);
+        for (int shard = 0; shard < shards_count_; ++shard) {
+            SendFully(connections[shard], &range_offsets[shard], sizeof(uint64_t));
+        }
+
+        for (int connection: connections) {
+            uint64_t done;
+            ReceiveFully(connection, &done, sizeof(done));
+        }
+    }
+
+    // Runs worker of shard, connections[peer] is its socket to peer, connections[shards_count_] to the coordinator
+    void RunWorker(int shard, const std::vector<int> &connections) {
+        int coordinator = connections[shards_count_];
+        std::string temp_file_name_mask = GetTempFileNameMask(input_file_, output_file_) + "_shard" + std::to_string(shard) + "_";
+        std::vector<std::string> run_file_names = FormRuns(shard, temp_file_name_mask);
+
+        std::vector<std::unique_ptr<RunReader>> runs;
+        std::vector<RunReader *> run_pointers;
+        for (std::string file_name: run_file_names) {
+            runs.emplace_back(new RunReader(file_name, 1, false));
+            run_pointers.push_back(runs.back().get());
+        }
+        std::vector<std::pair<uint64_t, double>> samples = SampleRuns(run_pointers, shards_count_);
+        uint64_t samples_count = samples.size();
+        SendFully(coordinator, &samples_count, sizeof(samples_count));
+        SendFully(coordinator, samples.data(), samples_count * sizeof(samples[0]));
+
+        std::vector<uint64_t> splitters(shards_count_ - 1);
+        ReceiveFully(coordinator, splitters.data(), splitters.size() * sizeof(uint64_t));
+        // run_bounds[run][range] is index of the first value of the range in the run
+        std::vector<std::vector<uint64_t>> run_bounds;
+        std::vector<uint64_t> range_sizes(shards_count_, 0);
+        for (RunReader *run: run_pointers) {
+            std::vector<uint64_t> bounds {0};
+            for (uint64_t splitter: splitters) {
+                bounds.push_back(run->LowerBound(splitter));
+            }
+            bounds.push_back(run->GetFooter().count);
+            for (int range = 0; range < shards_count_; ++range) {
+                range_sizes[range] += bounds[range + 1] - bounds[range];
+            }
+            run_bounds.push_back(bounds);
+        }
+        runs.clear();
+        SendFully(coordinator, range_sizes.data(), shards_count_ * sizeof(uint64_t));
+        uint64_t output_offset;
+        ReceiveFully(coordinator, &output_offset, sizeof(output_offset));
+
+        std::vector<std::vector<std::string>> received_file_names = ExchangeRanges(shard, connections, run_file_names, run_bounds, temp_file_name_mask);
+
+        // own range of every own run, and runs received from peers
+        std::vector<std::string> merged_file_names;
+        std::vector<std::pair<uint64_t, uint64_t>> merged_ranges;
+        for (size_t run = 0; run < run_file_names.size(); ++run) {
+            merged_file_names.push_back(run_file_names[run]);
+            merged_ranges.push_back(std::make_pair(run_bounds[run][shard], run_bounds[run][shard + 1]));
+        }
+        for (const std::vector<std::string> &peer_file_names: received_file_names) {
+            for (std::string file_name: peer_file_names) {
+                merged_file_names.push_back(file_name);
+                merged_ranges.push_back(std::make_pair(0, RUN_END));
+            }
+        }
+        long long buffer_size = GetMergeBufferSize(GetMergeMemorySize(parameters_.block_size), merged_file_names.size());
+        for (size_t run = 0; run < merged_file_names.size(); ++run) {
+            if (merged_ranges[run].first < merged_ranges[run].second) {
+                runs.emplace_back(new RunReader(merged_file_names[run], buffer_size, false, RUN_WITH_FOOTER, merged_ranges[run].first, merged_ranges[run].second));
+            }
+        }
+        run_pointers.clear();
+        for (const std::unique_ptr<RunReader> &run: runs) {
+            run_pointers.push_back(run.get());
+        }
+        RunWriter out_file(output_file_, false, output_offset);
+        long long values_left = std::numeric_limits<long long>::max();
+        MergeRunGroups(run_pointers, &out_file, &values_left);
+        out_file.Close();
+        runs.clear();
+        for (std::string file_name: merged_file_names) {
+            AnonymousFiles::Remove(file_name);
+        }
+
+        uint64_t done = 1;
+        SendFully(coordinator, &done, sizeof(done));
+    }
+
+    // Sorts slice of the input of shard into runs of block size, returns their names
+    std::vector<std::string> FormRuns(int shard, std::string temp_file_name_mask) {
+        long long values_count = GetFileSize(input_file_) / sizeof(uint64_t);
+        long long slice_begin = values_count * shard / shards_count_ * sizeof(uint64_t);
+        long long slice_end = values_count * (shard + 1) / shards_count_ * sizeof(uint64_t);
+
+        int in_fd = open(input_file_.c_str(), O_RDONLY);
+        if (in_fd < 0) {
+            throw std::runtime_error("Can't open input file " + input_file_);
+        }
+        std::vector<std::string> run_file_names;
+        try {
+            ReadBehind input_pages(in_fd, slice_begin);
+            ValueBuffer buffer(parameters_.block_size / sizeof(uint64_t));
+            for (long long offset = slice_begin; offset < slice_end; offset += parameters_.block_size) {
+                long long size = std::min(parameters_.block_size, slice_end - offset);
+                ReadFully(in_fd, &buffer[0], size, offset);
+                input_pages.Advance(offset + size);
+                size_t run_values_count = size / sizeof(uint64_t);
+                std::sort(buffer.begin(), buffer.begin() + run_values_count);
+
+                std::string temp_file_name = temp_file_name_mask + std::to_string(run_file_names.size());
+                run_file_names.push_back(temp_file_name);
+                RunWriter out_file(temp_file_name, true, ANONYMOUS_FILE);
+                out_file.Preallocate(run_values_count * sizeof(uint64_t) + sizeof(RunFooter));
+                out_file.Write(&buffer[0], run_values_count);
+                out_file.Close();
+            }
+        } catch (...) {
+            close(in_fd);
+            throw;
+        }
+        close(in_fd);
+        return run_file_names;
+    }
+
+    // Sends range of every peer to it and receives own range from every peer at the same time,
+    // so that no worker waits for a peer which waits for it
+    // Returns names of runs received from every peer
+    std::vector<std::vector<std::string>> ExchangeRanges(int shard, const std::vector<int> &connections, const std::vector<std::string> &run_file_names,
+                                                         const std::vector<std::vector<uint64_t>> &run_bounds, std::string temp_file_name_mask) {
+        std::vector<std::vector<std::string>> received_file_names(shards_count_);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        // a failed transfer shuts its socket down, so the peer doesn't wait for it forever
+        auto run_transfer = [&] (int peer, std::function<void ()> transfer) {
+            try {
+                transfer();
+            } catch (...) {
+                shutdown(connections[peer], SHUT_RDWR);
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!failed) {
+                    error = std::current_exception();
+                    failed = true;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int peer = 0; peer < shards_count_; ++peer) {
+            if (peer == shard) {
+                continue;
+            }
+            threads.emplace_back(run_transfer, peer, [&, peer] () {
+                SendRange(connections[peer], run_file_names, run_bounds, peer);
+            });
+            threads.emplace_back(run_transfer, peer, [&, peer] () {
+                received_file_names[peer] = ReceiveRuns(connections[peer], temp_file_name_mask + "from" + std::to_string(peer) + "_");
+            });
+        }
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+        if (failed) {
+            std::rethrow_exception(error);
+        }
+        return received_file_names;
+    }
+
+    // Sends values of range of every run as a count followed by the values, and count 0 after all runs
+    static void SendRange(int connection, const std::vector<std::string> &run_file_names, const std::vector<std::vector<uint64_t>> &run_bounds, int range) {
+        for (size_t run = 0; run < run_file_names.size(); ++run) {
+            uint64_t range_begin = run_bounds[run][range];
+            uint64_t range_end = run_bounds[run][range + 1];
+            if (range_begin == range_end) {
+                continue;
+            }
+            uint64_t count = range_end - range_begin;
+            SendFully(connection, &count, sizeof(count));
+            RunReader reader(run_file_names[run], READ_BUFFER_SIZE / sizeof(uint64_t), false, RUN_WITH_FOOTER, range_begin, range_end);
+            while (reader.HasValue()) {
+                size_t buffered_count = reader.GetBufferedCount();
+                SendFully(connection, reader.GetBufferedValues(), buffered_count * sizeof(uint64_t));
+                reader.Skip(buffered_count);
+            }
+        }
+        uint64_t end = 0;
+        SendFully(connection, &end, sizeof(end));
+    }
+
+    // Receives runs sent by SendRange and writes every one into an anonymous run, returns their names
+    static std::vector<std::string> ReceiveRuns(int connection, std::string temp_file_name_mask) {
+        std::vector<std::string> run_file_names;
+        ValueBuffer buffer(READ_BUFFER_SIZE / sizeof(uint64_t));
+        while (true) {
+            uint64_t count;
+            ReceiveFully(connection, &count, sizeof(count));
+            if (count == 0) {
+                break;
+            }
+            std::string temp_file_name = temp_file_name_mask + std::to_string(run_file_names.size());
+            run_file_names.push_back(temp_file_name);
+            RunWriter out_file(temp_file_name, true, ANONYMOUS_FILE);
+            out_file.Preallocate(count * sizeof(uint64_t) + sizeof(RunFooter));
+            while (count > 0) {
+                size_t chunk_count = std::min<uint64_t>(count, buffer.size());
+                ReceiveFully(connection, &buffer[0], chunk_count * sizeof(uint64_t));
+                out_file.Write(&buffer[0], chunk_count);
+                count -= chunk_count;
+            }
+            out_file.Close();
+        }
+        return run_file_names;
+    }
+
+    std::string input_file_;
+    std::string output_file_;
+    SortParameters parameters_;
+    int shards_count_;
+};
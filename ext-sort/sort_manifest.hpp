@@ -0,0 +1,214 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <stdexcept>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "run_file.hpp"
+
+// Durable record of the progress of a sort, which lets an interrupted sort continue from its last completed step
+// Manifest is a text file, its first line describes the sort (input and parameters),
+// and every completed step is appended as one line after the file made by the step is synced to disk:
+//   run NAME INPUT_SIZE COUNT CHECKSUM -- run formed from input up to INPUT_SIZE bytes
+//   chunk NAME INPUT_SIZE -- chunk of input up to INPUT_SIZE bytes is written
+//   sorted CHUNK NAME COUNT CHECKSUM -- chunk is sorted into run NAME, chunk file is not needed anymore
+// Steps of the previous attempt are kept if it sorted the same input with the same parameters,
+// and their files still have the recorded sizes and checksums, manifest is rewritten with just these steps
+class SortManifest {
+public:
+    SortManifest(std::string file_name, std::string description) :
+        file_name_(file_name),
+        formed_input_size_(0),
+        chunked_input_size_(0)
+    {
+        std::vector<std::string> steps = ReadSteps(description);
+
+        // new manifest replaces the old one only when it is on disk, so steps are never lost
+        std::string new_file_name = file_name + "_new";
+        file_descriptor_ = open(new_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (file_descriptor_ < 0) {
+            throw std::runtime_error("Can't create manifest " + file_name);
+        }
+        AppendLine(description);
+        for (std::string step: steps) {
+            AppendLine(step);
+        }
+        if (rename(new_file_name.c_str(), file_name.c_str()) != 0) {
+            throw std::runtime_error("Can't create manifest " + file_name);
+        }
+    }
+
+    ~SortManifest() {
+        if (file_descriptor_ >= 0) {
+            close(file_descriptor_);
+        }
+    }
+
+    SortManifest(const SortManifest &) = delete;
+    SortManifest &operator = (const SortManifest &) = delete;
+
+    // Runs formed from the beginning of input, in order
+    const std::vector<std::string> &GetFormedRuns() const {
+        return formed_runs_;
+    }
+
+    // Number of bytes of input from which the formed runs are made
+    long long GetFormedInputSize() const {
+        return formed_input_size_;
+    }
+
+    void AddFormedRun(std::string run_file_name, long long input_size, const RunFooter &footer) {
+        SyncFile(run_file_name);
+        AppendLine("run " + run_file_name + " " + std::to_string(input_size) + " " + GetFooterDescription(footer));
+        formed_runs_.push_back(run_file_name);
+        formed_input_size_ = input_size;
+    }
+
+    // Chunks written from the beginning of input, in order
+    const std::vector<std::string> &GetChunks() const {
+        return chunks_;
+    }
+
+    long long GetChunkedInputSize() const {
+        return chunked_input_size_;
+    }
+
+    void AddChunk(std::string chunk_file_name, long long input_size) {
+        SyncFile(chunk_file_name);
+        AppendLine("chunk " + chunk_file_name + " " + std::to_string(input_size));
+        chunks_.push_back(chunk_file_name);
+        chunked_input_size_ = input_size;
+    }
+
+    bool IsSorted(std::string run_file_name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sorted_runs_.count(run_file_name) > 0;
+    }
+
+    // Can be called by concurrent sorts
+    void AddSortedRun(std::string chunk_file_name, std::string run_file_name, const RunFooter &footer) {
+        SyncFile(run_file_name);
+        std::lock_guard<std::mutex> lock(mutex_);
+        AppendLine("sorted " + chunk_file_name + " " + run_file_name + " " + GetFooterDescription(footer));
+        sorted_runs_.insert(run_file_name);
+    }
+
+    // Removes manifest, when the sort is completed
+    void Remove() {
+        close(file_descriptor_);
+        file_descriptor_ = -1;
+        ::remove(file_name_.c_str());
+    }
+
+private:
+    static std::string GetFooterDescription(const RunFooter &footer) {
+        return std::to_string(footer.count) + " " + std::to_string(footer.checksum);
+    }
+
+    // Returns whether run file exists and has footer with the description
+    static bool HasFooter(std::string run_file_name, std::string footer_description) {
+        try {
+            return GetFooterDescription(RunReader(run_file_name, 1, false).GetFooter()) == footer_description;
+        } catch (std::runtime_error &) {
+            return false;
+        }
+    }
+
+    static void SyncFile(std::string file_name) {
+        int file_descriptor = open(file_name.c_str(), O_RDONLY);
+        bool synced = (file_descriptor >= 0 && fsync(file_descriptor) == 0);
+        if (file_descriptor >= 0) {
+            close(file_descriptor);
+        }
+        if (!synced) {
+            throw std::runtime_error("Can't sync file " + file_name);
+        }
+    }
+
+    void AppendLine(std::string line) {
+        line += "\n";
+        WriteFully(file_descriptor_, line.data(), line.size());
+        if (fdatasync(file_descriptor_) != 0) {
+            throw std::runtime_error("Can't sync manifest " + file_name_);
+        }
+    }
+
+    // Reads steps of the previous attempt which can be reused and returns their lines
+    std::vector<std::string> ReadSteps(std::string description) {
+        std::vector<std::string> steps;
+        std::ifstream manifest(file_name_);
+        std::string line;
+        if (!std::getline(manifest, line) || line != description) {
+            return steps;
+        }
+
+        std::vector<std::string> lines;
+        while (std::getline(manifest, line)) {
+            lines.push_back(line);
+        }
+
+        // chunk which is sorted is not needed, even if its file is removed
+        std::set<std::string> sorted_chunks;
+        for (std::string line: lines) {
+            std::istringstream step(line);
+            std::string kind, chunk_name, name, footer_description;
+            step >> kind >> chunk_name >> name >> std::ws;
+            std::getline(step, footer_description);
+            if (kind == "sorted" && HasFooter(name, footer_description)) {
+                sorted_chunks.insert(chunk_name);
+                sorted_runs_.insert(name);
+                steps.push_back(line);
+            }
+        }
+
+        // runs and chunks are reused up to the first one which is lost
+        bool runs_valid = true;
+        bool chunks_valid = true;
+        for (std::string line: lines) {
+            std::istringstream step(line);
+            std::string kind, name;
+            step >> kind >> name;
+            if (kind == "run") {
+                long long input_size;
+                std::string footer_description;
+                step >> input_size >> std::ws;
+                std::getline(step, footer_description);
+                runs_valid = runs_valid && HasFooter(name, footer_description);
+                if (runs_valid) {
+                    formed_runs_.push_back(name);
+                    formed_input_size_ = input_size;
+                    steps.push_back(line);
+                }
+            } else if (kind == "chunk") {
+                long long input_size = 0;
+                step >> input_size;
+                struct stat stat_buf;
+                chunks_valid = chunks_valid && (sorted_chunks.count(name) > 0 ||
+                               (stat(name.c_str(), &stat_buf) == 0 && stat_buf.st_size == input_size - chunked_input_size_));
+                if (chunks_valid) {
+                    chunks_.push_back(name);
+                    chunked_input_size_ = input_size;
+                    steps.push_back(line);
+                }
+            }
+        }
+        return steps;
+    }
+
+    std::string file_name_;
+    int file_descriptor_;
+    mutable std::mutex mutex_;
+    std::vector<std::string> formed_runs_;
+    long long formed_input_size_;
+    std::vector<std::string> chunks_;
+    long long chunked_input_size_;
+    std::set<std::string> sorted_runs_;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+
+// Phases of a merge sort, in the order they run
+enum class SortPhase {
+    // input is read and sorted into runs (recursively, if it needs several passes)
+    FORM_RUNS,
+    // runs are merged in groups of branching degree, until few enough are left for one merge
+    MERGE_PASS,
+    // remaining runs are merged into the output
+    FINAL_MERGE
+};
+
+inline std::string GetPhaseName(SortPhase phase) {
+    switch (phase) {
+    case SortPhase::FORM_RUNS:
+        return "form_runs";
+    case SortPhase::MERGE_PASS:
+        return "merge_pass";
+    default:
+        return "final_merge";
+    }
+}
+
+// Receives phases and progress of a sort, see SortParameters::observer
+// Only the outermost sort reports, recursive sorts count as progress of its phase
+class SortObserver {
+public:
+    virtual ~SortObserver() {}
+
+    // Called before phase starts, which reads bytes_count bytes and writes runs_count runs (-1 if unknown),
+    // may wait until the phase can use the devices of the sort
+    virtual void BeginPhase(SortPhase phase, long long bytes_count, long long runs_count) = 0;
+    // Called when another bytes_read bytes are read and bytes_written bytes are written by the current phase,
+    // may be called from several threads
+    virtual void AddProgress(long long bytes_read, long long bytes_written) = 0;
+    // Called when another run of the current phase is written
+    virtual void AddRun() = 0;
+    // Called when phase ends, also when it fails
+    virtual void EndPhase(SortPhase phase) = 0;
+};
+
+// Reports phase to observer from construction to destruction, does nothing for nullptr observer
+class ObservedPhase {
+public:
+    ObservedPhase(SortObserver *observer, SortPhase phase, long long bytes_count, long long runs_count) :
+        observer_(observer),
+        phase_(phase)
+    {
+        if (observer_ != nullptr) {
+            observer_->BeginPhase(phase_, bytes_count, runs_count);
+        }
+    }
+
+    ~ObservedPhase() {
+        if (observer_ != nullptr) {
+            observer_->EndPhase(phase_);
+        }
+    }
+
+    ObservedPhase(const ObservedPhase &) = delete;
+    ObservedPhase &operator = (const ObservedPhase &) = delete;
+
+    void AddProgress(long long bytes_read, long long bytes_written) {
+        if (observer_ != nullptr) {
+            observer_->AddProgress(bytes_read, bytes_written);
+        }
+    }
+
+    void AddRun() {
+        if (observer_ != nullptr) {
+            observer_->AddRun();
+        }
+    }
+
+private:
+    SortObserver *observer_;
+    SortPhase phase_;
+};
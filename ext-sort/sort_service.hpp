@@ -0,0 +1,403 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "external_sort.hpp"
+#include "huge_page_allocator.hpp"
+#include "sort_observer.hpp"
+
+// Sorts are submitted to SortService over a Unix socket with a text protocol
+// Request is three lines:
+//     sort <block_size> <branching_degree> <limit> <jobs> <verify>
+//     <absolute name of input file>
+//     <absolute name of output file>
+// Service answers with lines, the last one is done or error:
+//     queued <number of sorts ahead>
+//     started <block_size>
+//     phase <phase name> <bytes of the phase, -1 if unknown>
+//     progress <bytes done> <bytes of the phase>
+//     done
+//     error <message>
+const std::string SORT_REQUEST = "sort";
+const std::string QUEUED_REPLY = "queued";
+const std::string STARTED_REPLY = "started";
+const std::string PHASE_REPLY = "phase";
+const std::string PROGRESS_REPLY = "progress";
+const std::string DONE_REPLY = "done";
+const std::string ERROR_REPLY = "error";
+
+// Sort submitted to SortService
+struct SortRequest {
+    std::string input_file;
+    std::string output_file;
+    long long block_size;
+    int branching_degree;
+    long long limit;
+    int jobs;
+    bool verify;
+};
+
+// Reads line without the line break from socket, returns false if connection is closed before it
+inline bool ReadLine(int connection, std::string *line) {
+    line->clear();
+    char symbol;
+    while (true) {
+        ssize_t bytes_read = read(connection, &symbol, 1);
+        if (bytes_read <= 0) {
+            return false;
+        }
+        if (symbol == '\n') {
+            return true;
+        }
+        line->push_back(symbol);
+    }
+}
+
+// Writes line into socket, failure is ignored, so that sort goes on if its client goes away
+inline void WriteLine(int connection, std::string line) {
+    line.push_back('\n');
+    size_t written = 0;
+    while (written < line.size()) {
+        ssize_t bytes_written = send(connection, line.data() + written, line.size() - written, MSG_NOSIGNAL);
+        if (bytes_written <= 0) {
+            return;
+        }
+        written += bytes_written;
+    }
+}
+
+inline sockaddr_un GetSocketAddress(std::string socket_name) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_name.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket name " + socket_name + " is too long");
+    }
+    strcpy(address.sun_path, socket_name.c_str());
+    return address;
+}
+
+// Returns device of file, or of its directory if file doesn't exist yet
+inline dev_t GetFileDevice(std::string file_name) {
+    struct stat stat_buf;
+    if (stat(file_name.c_str(), &stat_buf) == 0) {
+        return stat_buf.st_dev;
+    }
+    std::string directory = file_name.substr(0, file_name.rfind('/') + 1);
+    return stat((directory.empty() ? "." : directory).c_str(), &stat_buf) == 0 ? stat_buf.st_dev : 0;
+}
+
+// Makes files opened by the calling thread, and by threads it starts, checked against permissions of the client
+// on the other end of connection (its user, group and supplementary groups), instead of those of the service
+// Service of another user than the client needs CAP_SETUID and CAP_SETGID (e.g. runs as root), otherwise throws
+inline void ActAsClient(int connection) {
+    ucred client;
+    socklen_t length = sizeof(client);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &client, &length) != 0) {
+        throw std::runtime_error("Can't get credentials of client");
+    }
+    if (client.uid == geteuid() && client.gid == getegid()) {
+        return;
+    }
+    std::vector<gid_t> groups {client.gid};
+#ifdef SO_PEERGROUPS
+    // buffer is grown to the size the kernel asks for
+    std::vector<gid_t> peer_groups(64);
+    socklen_t groups_length = peer_groups.size() * sizeof(gid_t);
+    int rc = getsockopt(connection, SOL_SOCKET, SO_PEERGROUPS, peer_groups.data(), &groups_length);
+    if (rc != 0 && errno == ERANGE) {
+        peer_groups.resize(groups_length / sizeof(gid_t));
+        rc = getsockopt(connection, SOL_SOCKET, SO_PEERGROUPS, peer_groups.data(), &groups_length);
+    }
+    if (rc == 0) {
+        groups.insert(groups.end(), peer_groups.begin(), peer_groups.begin() + groups_length / sizeof(gid_t));
+    }
+#endif
+    // raw system calls change only the calling thread, libc wrappers of setgroups would change the whole process
+    // setfsuid and setfsgid with -1 return the current identity without changing it
+    bool switched = (syscall(SYS_setgroups, groups.size(), groups.data()) == 0);
+    if (switched) {
+        syscall(SYS_setfsgid, client.gid);
+        syscall(SYS_setfsuid, client.uid);
+        switched = (syscall(SYS_setfsgid, -1) == (long) client.gid && syscall(SYS_setfsuid, -1) == (long) client.uid);
+    }
+    if (!switched) {
+        throw std::runtime_error("Sort service can't open files as user " + std::to_string(client.uid));
+    }
+}
+
+// Runs sorts of several clients in one process within budgets shared by all of them:
+// sorts start in the order they are submitted, once memory_budget has room for the block and buffers of the next one
+// and fewer than jobs sorts run, block of a sort is cut to fit into the whole budget
+// Every sort allocates its buffers from a MemoryArena of the memory it was granted, so it can't go over its part
+// Files of a sort are opened with permissions of its client, see ActAsClient
+// Phases of sorts (see sort_observer.hpp) are scheduled on devices: at most device_phases phases
+// read or write the same device at the same time, so that sorts forming runs and merging share the devices
+// without seeking between too many files, final merge takes both the device of temporary files and of the output
+// Sorts of the same input file don't run at the same time, since their temporary files have the same names
+class SortService {
+public:
+    SortService(long long memory_budget, int jobs, int device_phases) :
+        memory_budget_(memory_budget),
+        jobs_(jobs),
+        device_phases_(device_phases),
+        memory_used_(0),
+        running_jobs_(0),
+        next_ticket_(0),
+        next_admitted_ticket_(0)
+    {}
+
+    // Reads request from connection, runs the sort and reports it into connection
+    // Files are opened with permissions of the client, so the calling thread must serve only this connection
+    void Serve(int connection) {
+        try {
+            ActAsClient(connection);
+            SortRequest request = ReadRequest(connection);
+            Sort(request, connection);
+            WriteLine(connection, DONE_REPLY);
+        } catch (std::exception &err) {
+            WriteLine(connection, ERROR_REPLY + " " + err.what());
+        }
+    }
+
+private:
+    // Reports phases of a sort into its connection and holds devices of its current phase
+    class JobObserver : public SortObserver {
+    public:
+        JobObserver(SortService *service, int connection, const SortRequest &request) :
+            service_(service),
+            connection_(connection),
+            input_device_(GetFileDevice(request.input_file)),
+            output_device_(GetFileDevice(request.output_file)),
+            done_bytes_(0),
+            phase_bytes_(0)
+        {}
+
+        void BeginPhase(SortPhase phase, long long bytes_count, long long) override {
+            devices_ = {input_device_};
+            if (phase == SortPhase::FINAL_MERGE && output_device_ != input_device_) {
+                devices_.push_back(output_device_);
+            }
+            service_->AcquireDevices(devices_);
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_bytes_ = 0;
+            phase_bytes_ = bytes_count;
+            WriteLine(connection_, PHASE_REPLY + " " + GetPhaseName(phase) + " " + std::to_string(bytes_count));
+        }
+
+        // client is told about read bytes only
+        void AddProgress(long long bytes_read, long long) override {
+            if (bytes_read == 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_bytes_ += bytes_read;
+            WriteLine(connection_, PROGRESS_REPLY + " " + std::to_string(done_bytes_) + " " + std::to_string(phase_bytes_));
+        }
+
+        void AddRun() override {}
+
+        void EndPhase(SortPhase) override {
+            service_->ReleaseDevices(devices_);
+        }
+
+    private:
+        SortService *service_;
+        int connection_;
+        dev_t input_device_;
+        dev_t output_device_;
+        // devices held by the current phase
+        std::vector<dev_t> devices_;
+        std::mutex mutex_;
+        long long done_bytes_;
+        long long phase_bytes_;
+    };
+
+    static SortRequest ReadRequest(int connection) {
+        std::string header;
+        SortRequest request;
+        if (!ReadLine(connection, &header) || !ReadLine(connection, &request.input_file) || !ReadLine(connection, &request.output_file)) {
+            throw std::runtime_error("Incomplete request");
+        }
+        std::istringstream fields(header);
+        std::string command;
+        if (!(fields >> command >> request.block_size >> request.branching_degree >> request.limit >> request.jobs >> request.verify) ||
+            command != SORT_REQUEST) {
+            throw std::runtime_error("Invalid request " + header);
+        }
+        if (request.input_file.empty() || request.input_file[0] != '/' || request.output_file.empty() || request.output_file[0] != '/') {
+            throw std::runtime_error("File names must be absolute");
+        }
+        if (request.block_size < (long long) sizeof(uint64_t) || request.branching_degree < 2 || request.jobs < 1 || request.limit < NO_LIMIT) {
+            throw std::runtime_error("Invalid sort parameters " + header);
+        }
+        return request;
+    }
+
+    void Sort(const SortRequest &request, int connection) {
+        long long buffers_size = GetBuffersSize(request.jobs);
+        long long block_size = std::min(request.block_size, memory_budget_ - buffers_size) / sizeof(uint64_t) * sizeof(uint64_t);
+        if (block_size < (long long) sizeof(uint64_t)) {
+            throw std::runtime_error("Buffers of " + std::to_string(request.jobs) + " jobs don't fit into memory budget");
+        }
+        long long memory = block_size + buffers_size;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            long long ticket = next_ticket_++;
+            WriteLine(connection, QUEUED_REPLY + " " + std::to_string(ticket - next_admitted_ticket_));
+            changed_.wait(lock, [&] () {
+                return ticket == next_admitted_ticket_ && running_jobs_ < jobs_ &&
+                       memory_used_ + memory <= memory_budget_ && sorted_inputs_.count(request.input_file) == 0;
+            });
+            ++next_admitted_ticket_;
+            ++running_jobs_;
+            memory_used_ += memory;
+            sorted_inputs_.insert(request.input_file);
+            changed_.notify_all();
+        }
+        WriteLine(connection, STARTED_REPLY + " " + std::to_string(block_size));
+
+        JobObserver observer(this, connection, request);
+        SortParameters parameters {block_size, request.branching_degree, request.limit, request.jobs, NO_DEVICE_JOBS_LIMIT,
+                                   request.verify, false, 1, NO_INDEX, false, false, &observer, false};
+        try {
+            MemoryArena arena(memory);
+            MemoryArenaScope arena_scope(&arena);
+            ExternalMergeSort(request.input_file, request.output_file, parameters);
+        } catch (...) {
+            Leave(request, memory);
+            throw;
+        }
+        Leave(request, memory);
+    }
+
+    void Leave(const SortRequest &request, long long memory) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --running_jobs_;
+        memory_used_ -= memory;
+        sorted_inputs_.erase(request.input_file);
+        changed_.notify_all();
+    }
+
+    // Waits until all devices have a free phase slot and takes them at once
+    void AcquireDevices(const std::vector<dev_t> &devices) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] () {
+            for (dev_t device: devices) {
+                if (device_phases_used_[device] >= device_phases_) {
+                    return false;
+                }
+            }
+            return true;
+        });
+        for (dev_t device: devices) {
+            ++device_phases_used_[device];
+        }
+    }
+
+    void ReleaseDevices(const std::vector<dev_t> &devices) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (dev_t device: devices) {
+            --device_phases_used_[device];
+        }
+        changed_.notify_all();
+    }
+
+    long long memory_budget_;
+    int jobs_;
+    int device_phases_;
+
+    // state below is guarded by mutex_, changed_ is notified when any of it changes
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    long long memory_used_;
+    int running_jobs_;
+    // sorts are admitted in the order of tickets they got when they were submitted
+    long long next_ticket_;
+    long long next_admitted_ticket_;
+    std::set<std::string> sorted_inputs_;
+    // number of running phases on every device
+    std::map<dev_t, int> device_phases_used_;
+};
+
+inline std::string GetAbsolutePath(std::string file_name) {
+    if (!file_name.empty() && file_name[0] == '/') {
+        return file_name;
+    }
+    std::vector<char> directory(4096);
+    if (getcwd(directory.data(), directory.size()) == nullptr) {
+        throw std::runtime_error("Can't get current directory");
+    }
+    return std::string(directory.data()) + "/" + file_name;
+}
+
+// Submits sort to the service listening on socket_name and waits until it is done,
+// writing its progress into progress stream, throws if the service fails the sort
+inline void SortWithService(std::string socket_name, SortRequest request, std::ostream *progress) {
+    sockaddr_un address = GetSocketAddress(socket_name);
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (sockaddr *) &address, sizeof(address)) != 0) {
+        if (connection >= 0) {
+            close(connection);
+        }
+        throw std::runtime_error("Can't connect to sort service at " + socket_name);
+    }
+    WriteLine(connection, SORT_REQUEST + " " + std::to_string(request.block_size) + " " + std::to_string(request.branching_degree) + " " +
+                          std::to_string(request.limit) + " " + std::to_string(request.jobs) + " " + std::to_string(request.verify));
+    WriteLine(connection, GetAbsolutePath(request.input_file));
+    WriteLine(connection, GetAbsolutePath(request.output_file));
+
+    std::string line;
+    std::string phase_name;
+    while (ReadLine(connection, &line)) {
+        std::istringstream fields(line);
+        std::string reply;
+        fields >> reply;
+        if (reply == DONE_REPLY) {
+            close(connection);
+            return;
+        } else if (reply == ERROR_REPLY) {
+            close(connection);
+            throw std::runtime_error(line.substr(std::min(line.size(), ERROR_REPLY.size() + 1)));
+        } else if (reply == QUEUED_REPLY) {
+            int ahead;
+            fields >> ahead;
+            *progress << "Queued behind " << ahead << " sorts" << std::endl;
+        } else if (reply == STARTED_REPLY) {
+            long long block_size;
+            fields >> block_size;
+            *progress << "Started with block size " << block_size << std::endl;
+        } else if (reply == PHASE_REPLY) {
+            long long bytes_count;
+            fields >> phase_name >> bytes_count;
+            *progress << "Phase " << phase_name << std::endl;
+        } else if (reply == PROGRESS_REPLY) {
+            long long done_bytes, bytes_count;
+            fields >> done_bytes >> bytes_count;
+            *progress << phase_name << ": " << done_bytes;
+            if (bytes_count > 0) {
+                *progress << " of " << bytes_count;
+            }
+            *progress << " bytes" << std::endl;
+        }
+    }
+    close(connection);
+    throw std::runtime_error("Sort service closed connection before the sort was done");
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "run_file.hpp"
+
+// Returns name of the sparse index file of a sorted file
+inline std::string GetIndexFileName(std::string sorted_file_name) {
+    return sorted_file_name + ".idx";
+}
+
+// Sorted file with its sparse index (see SparseIndexWriter), both memory mapped
+// Lower bound searches the index, which stays in memory after the first lookups,
+// and then reads only values between two neighbouring indexed values,
+// so with interval of a page a lookup reads one or two pages of the sorted file
+class IndexedSortedFile {
+public:
+    explicit IndexedSortedFile(std::string sorted_file_name) :
+        index_(nullptr),
+        index_size_(0),
+        values_(nullptr),
+        values_size_(0)
+    {
+        std::string index_file_name = GetIndexFileName(sorted_file_name);
+        index_ = MapWholeFile(index_file_name, &index_size_);
+        const SparseIndexHeader *header = (const SparseIndexHeader *) index_;
+        if (index_size_ < (long long) sizeof(SparseIndexHeader) ||
+            header->magic != SPARSE_INDEX_MAGIC ||
+            header->entries_count * sizeof(SparseIndexEntry) + sizeof(SparseIndexHeader) != (uint64_t) index_size_) {
+            Unmap();
+            throw std::runtime_error("Index file " + index_file_name + " is corrupted");
+        }
+
+        try {
+            values_ = (const uint64_t *) MapWholeFile(sorted_file_name, &values_size_);
+        } catch (...) {
+            Unmap();
+            throw;
+        }
+        if ((uint64_t) values_size_ < header->values_count * sizeof(uint64_t)) {
+            Unmap();
+            throw std::runtime_error("Sorted file " + sorted_file_name + " doesn't match its index");
+        }
+        if (values_ != nullptr) {
+            // lookups touch few pages at random places, read-ahead would only waste IO
+            madvise((void *) values_, values_size_, MADV_RANDOM);
+        }
+    }
+
+    ~IndexedSortedFile() {
+        Unmap();
+    }
+
+    IndexedSortedFile(const IndexedSortedFile &) = delete;
+    IndexedSortedFile &operator = (const IndexedSortedFile &) = delete;
+
+    // Number of values in the sorted file
+    uint64_t GetSize() const {
+        return GetHeader().values_count;
+    }
+
+    uint64_t GetValue(uint64_t index) const {
+        return values_[index];
+    }
+
+    // Returns index of the first value not less than key, or GetSize() if there is no such value
+    uint64_t LowerBound(uint64_t key) const {
+        const SparseIndexEntry *entries_begin = GetEntries();
+        const SparseIndexEntry *entries_end = entries_begin + GetHeader().entries_count;
+        // first indexed value not less than key bounds the search from above,
+        // the indexed value before it bounds it from below
+        const SparseIndexEntry *entry = std::lower_bound(entries_begin, entries_end, key,
+            [] (const SparseIndexEntry &one, uint64_t key) {
+                return one.key < key;
+            });
+        uint64_t end = (entry == entries_end ? GetSize() : entry->offset / sizeof(uint64_t));
+        uint64_t begin = (entry == entries_begin ? 0 : (entry - 1)->offset / sizeof(uint64_t));
+        return std::lower_bound(values_ + begin, values_ + end, key) - values_;
+    }
+
+private:
+    // Maps the whole file for reading and stores its size, returns nullptr for empty file
+    static void *MapWholeFile(std::string file_name, long long *size) {
+        int file_descriptor = open(file_name.c_str(), O_RDONLY);
+        struct stat stat_buf;
+        if (file_descriptor < 0 || fstat(file_descriptor, &stat_buf) != 0) {
+            if (file_descriptor >= 0) {
+                close(file_descriptor);
+            }
+            throw std::runtime_error("Can't open file " + file_name);
+        }
+        *size = stat_buf.st_size;
+        void *data = nullptr;
+        if (*size > 0) {
+            data = mmap(nullptr, *size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+        }
+        close(file_descriptor);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Can't map file " + file_name + " into memory");
+        }
+        return data;
+    }
+
+    void Unmap() {
+        if (values_ != nullptr) {
+            munmap((void *) values_, values_size_);
+            values_ = nullptr;
+        }
+        if (index_ != nullptr) {
+            munmap(index_, index_size_);
+            index_ = nullptr;
+        }
+    }
+
+    const SparseIndexHeader &GetHeader() const {
+        return *(const SparseIndexHeader *) index_;
+    }
+
+    const SparseIndexEntry *GetEntries() const {
+        return (const SparseIndexEntry *) ((const char *) index_ + sizeof(SparseIndexHeader));
+    }
+
+    void *index_;
+    long long index_size_;
+    const uint64_t *values_;
+    long long values_size_;
+};